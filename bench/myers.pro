@@ -0,0 +1,27 @@
+# Checks Myers against a dynamic-programming LCS and times it against
+# difflib's SequenceMatcher, on random sequences and, optionally, on the
+# pages of pairs of PDFs:
+#   cd bench && qmake myers.pro && make
+#   ./myers_bench [old1.pdf new1.pdf [old2.pdf new2.pdf ...]]
+TEMPLATE      = app
+TARGET        = myers_bench
+CONFIG       += console release
+CONFIG       -= app_bundle
+INCLUDEPATH  += ..
+HEADERS	     += ../generic.hpp
+SOURCES	     += ../generic.cpp
+HEADERS	     += ../ranges.hpp
+SOURCES      += ../ranges.cpp
+HEADERS	     += ../textitem.hpp
+SOURCES	     += ../textitem.cpp
+HEADERS	     += ../sequence_matcher.hpp
+SOURCES      += ../sequence_matcher.cpp
+HEADERS	     += ../myers.hpp
+SOURCES      += ../myers.cpp
+SOURCES      += myers_bench.cpp
+LIBS	     += -lpoppler-qt4
+exists(/usr/include/poppler/qt4) {
+    INCLUDEPATH += /usr/include/poppler/qt4
+} else {
+    INCLUDEPATH += /usr/local/include/poppler/qt4
+}
@@ -0,0 +1,238 @@
+/*
+    Copyright © 2011-13 Qtrac Ltd. All rights reserved.
+    This program or module is free software: you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 2 of
+    the License, or (at your option) any later version. This program is
+    distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+    for more details.
+*/
+
+// Checks that MyersDiff's blocks are ordered, match equal elements and
+// cover a longest common subsequence (found by dynamic programming) of
+// 3000 random pairs of sequences, and that SequenceMatcher's are valid
+// too (difflib's needn't be longest). Then times the two on long random
+// sequences, and on the words and characters of each pair of pages of
+// any pairs of PDFs given. Exits with 1 if any check fails.
+
+#include "generic.hpp"
+#include "myers.hpp"
+#include "sequence_matcher.hpp"
+#include "textitem.hpp"
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <QVector>
+#include <cstdlib>
+
+
+// Returns the number of elements matched, or -1 if the blocks are out
+// of order, overlap or match unequal elements
+static int matchedCount(const QList<Match> &matches, const Sequence &a,
+                        const Sequence &b)
+{
+    int count = 0;
+    int i = 0;
+    int j = 0;
+    foreach (const Match &match, matches) {
+        if (match.size == 0)
+            continue;
+        if (match.i < i || match.j < j || match.i + match.size > a.count() ||
+            match.j + match.size > b.count())
+            return -1;
+        for (int k = 0; k < match.size; ++k)
+            if (a.at(match.i + k) != b.at(match.j + k))
+                return -1;
+        i = match.i + match.size;
+        j = match.j + match.size;
+        count += match.size;
+    }
+    return count;
+}
+
+
+static int lcsLength(const Sequence &a, const Sequence &b)
+{
+    QVector<int> previous(b.count() + 1, 0);
+    QVector<int> current(b.count() + 1, 0);
+    for (int i = 1; i <= a.count(); ++i) {
+        for (int j = 1; j <= b.count(); ++j)
+            current[j] = a.at(i - 1) == b.at(j - 1)
+                ? previous.at(j - 1) + 1
+                : qMax(previous.at(j), current.at(j - 1));
+        qSwap(previous, current);
+    }
+    return previous.at(b.count());
+}
+
+
+static Sequence randomSequence(const int length, const int alphabet)
+{
+    Sequence sequence;
+    sequence.reserve(length);
+    for (int i = 0; i < length; ++i)
+        sequence << std::rand() % alphabet;
+    return sequence;
+}
+
+
+// A copy of sequence with about percent of its elements replaced,
+// deleted or preceded by an insertion
+static Sequence edited(const Sequence &sequence, const int percent,
+                       const int alphabet)
+{
+    Sequence result;
+    foreach (const Element element, sequence) {
+        if (std::rand() % 100 >= percent)
+            result << element;
+        else {
+            switch (std::rand() % 3) {
+                case 0: result << std::rand() % alphabet; break;
+                case 1: break;
+                case 2: result << std::rand() % alphabet << element; break;
+            }
+        }
+    }
+    return result;
+}
+
+
+static bool check(QTextStream *out)
+{
+    int failures = 0;
+    qint64 lcsTotal = 0;
+    qint64 difflibTotal = 0;
+    std::srand(1);
+    for (int i = 0; i < 3000; ++i) {
+        const int alphabet = 2 + std::rand() % 30;
+        const Sequence a = randomSequence(std::rand() % 80, alphabet);
+        const Sequence b = std::rand() % 2
+                ? edited(a, std::rand() % 50, alphabet)
+                : randomSequence(std::rand() % 80, alphabet);
+        const int lcs = lcsLength(a, b);
+        MyersDiff myers(a, b);
+        SequenceMatcher matcher(a, b);
+        const int myersCount = matchedCount(myers.get_matching_blocks(),
+                                            a, b);
+        const int difflibCount = matchedCount(matcher.get_matching_blocks(),
+                                              a, b);
+        if (myersCount != lcs || difflibCount == -1 || difflibCount > lcs) {
+            ++failures;
+            *out << "MISMATCH: lengths " << a.count() << ", " << b.count()
+                 << ": LCS " << lcs << ", myers " << myersCount
+                 << ", difflib " << difflibCount << "\n";
+        }
+        lcsTotal += lcs;
+        difflibTotal += qMax(0, difflibCount);
+    }
+    *out << "checked 3000 pairs: " << failures << " failures; difflib "
+         << "matched " << difflibTotal << " of the " << lcsTotal
+         << " LCS elements\n";
+    return failures == 0;
+}
+
+
+struct Timing
+{
+    Timing() : myers(0), difflib(0), myersMatched(0), difflibMatched(0) {}
+
+    qint64 myers; // nanoseconds
+    qint64 difflib;
+    qint64 myersMatched;
+    qint64 difflibMatched;
+};
+
+
+static void timeDiffs(const Sequence &a, const Sequence &b,
+                      Timing *timing)
+{
+    QElapsedTimer timer;
+    timer.start();
+    MyersDiff myers(a, b);
+    const QList<Match> myersMatches = myers.get_matching_blocks();
+    timing->myers += timer.nsecsElapsed();
+    timer.start();
+    SequenceMatcher matcher(a, b);
+    const QList<Match> difflibMatches = matcher.get_matching_blocks();
+    timing->difflib += timer.nsecsElapsed();
+    timing->myersMatched += matchedCount(myersMatches, a, b);
+    timing->difflibMatched += matchedCount(difflibMatches, a, b);
+}
+
+
+static void report(QTextStream *out, const QString &name,
+                   const Timing &timing)
+{
+    *out << name << ": myers " << timing.myers / 1000 << " us ("
+         << timing.myersMatched << " matched), difflib "
+         << timing.difflib / 1000 << " us (" << timing.difflibMatched
+         << " matched)\n";
+}
+
+
+static void timeRandom(QTextStream *out)
+{
+    const int Lengths[] = {1000, 5000, 10000};
+    const int Percents[] = {1, 10, 50};
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            // About as many distinct tokens as there are characters
+            const Sequence a = randomSequence(Lengths[i], 80);
+            const Sequence b = edited(a, Percents[j], 80);
+            Timing timing;
+            timeDiffs(a, b, &timing);
+            report(out, QString("%1 tokens, %2% edited").arg(Lengths[i])
+                   .arg(Percents[j]), timing);
+        }
+    }
+}
+
+
+static bool timePdfs(QTextStream *out, const QString &filename1,
+                     const QString &filename2)
+{
+    PdfDocument pdf1(Poppler::Document::load(filename1));
+    PdfDocument pdf2(Poppler::Document::load(filename2));
+    if (!pdf1 || !pdf2 || pdf1->isLocked() || pdf2->isLocked()) {
+        *out << "cannot read '" << filename1 << "' or '" << filename2
+             << "'\n";
+        return false;
+    }
+    Timing words;
+    Timing characters;
+    const int Pages = qMin(pdf1->numPages(), pdf2->numPages());
+    for (int page = 0; page < Pages; ++page) {
+        PdfPage page1(pdf1->page(page));
+        PdfPage page2(pdf2->page(page));
+        if (!page1 || !page2)
+            continue;
+        const TextBoxList boxes1 = getTextBoxes(page1);
+        const TextBoxList boxes2 = getTextBoxes(page2);
+        TokenTable wordTokens;
+        timeDiffs(wordTokens.intern(getWords(boxes1)),
+                  wordTokens.intern(getWords(boxes2)), &words);
+        TokenTable characterTokens;
+        timeDiffs(characterTokens.intern(getCharacters(boxes1)),
+                  characterTokens.intern(getCharacters(boxes2)), &characters);
+    }
+    const QString name = QString("%1 vs %2, %3 pages").arg(filename1)
+                         .arg(filename2).arg(Pages);
+    report(out, name + ", words", words);
+    report(out, name + ", characters", characters);
+    return true;
+}
+
+
+int main(int argc, char *argv[])
+{
+    QTextStream out(stdout);
+    if (!check(&out))
+        return 1;
+    timeRandom(&out);
+    for (int i = 1; i + 1 < argc; i += 2)
+        if (!timePdfs(&out, QString::fromLocal8Bit(argv[i]),
+                      QString::fromLocal8Bit(argv[i + 1])))
+            return 2;
+    return 0;
+}
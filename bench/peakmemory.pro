@@ -0,0 +1,11 @@
+# Checks that diffpdf stays within --maxMemory, by measuring the peak
+# resident memory of diffpdf runs on a pair of PDFs (ideally of large
+# pages, e.g., A0 drawings, so that they're compared in bands):
+#   cd bench && qmake peakmemory.pro && make
+#   ./peakmemory_bench ../diffpdf old.pdf new.pdf [maxMemory [jobs]]
+TEMPLATE      = app
+TARGET        = peakmemory_bench
+CONFIG       += console release
+CONFIG       -= app_bundle
+QT           -= gui
+SOURCES      += peakmemory_bench.cpp
@@ -0,0 +1,114 @@
+/*
+    Copyright © 2011-13 Qtrac Ltd. All rights reserved.
+    This program or module is free software: you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 2 of
+    the License, or (at your option) any later version. This program is
+    distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+    for more details.
+*/
+
+// Runs diffpdf on a pair of PDFs and measures the peak resident memory
+// of each run. The baseline is a --check of the text, which loads the
+// documents and extracts their text but renders nothing; the visual
+// diffs, written as a PDF and as PNGs with --maxMemory, must then peak
+// at no more than the baseline plus maxMemory (with a little slack for
+// the allocator). Exits with 1 if any run exceeds that, or fails.
+
+#include <QDir>
+#include <QFile>
+#include <QStringList>
+#include <QTextStream>
+#include <QVector>
+#include <cstdlib>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+// Returns the peak resident set size in KB of running the program with
+// the arguments, or -1 if it couldn't be run or was killed. The exit
+// status is put in status.
+static long peakKilobytes(const QString &program, const QStringList &args,
+                          int *status)
+{
+    QList<QByteArray> strings;
+    strings << QFile::encodeName(program);
+    foreach (const QString &arg, args)
+        strings << QFile::encodeName(arg);
+    QVector<char*> argv;
+    for (int i = 0; i < strings.count(); ++i)
+        argv << strings[i].data();
+    argv << 0;
+    const pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    int waitStatus;
+    struct rusage usage;
+    if (wait4(pid, &waitStatus, 0, &usage) != pid ||
+        !WIFEXITED(waitStatus))
+        return -1;
+    *status = WEXITSTATUS(waitStatus);
+    return usage.ru_maxrss; // KB on Linux
+}
+
+
+int main(int argc, char *argv[])
+{
+    QTextStream out(stdout);
+    if (argc < 4) {
+        out << "usage: peakmemory_bench diffpdf old.pdf new.pdf "
+               "[maxMemory [jobs]]\n";
+        return 1;
+    }
+    const QString diffpdf = QString::fromLocal8Bit(argv[1]);
+    const QString filename1 = QString::fromLocal8Bit(argv[2]);
+    const QString filename2 = QString::fromLocal8Bit(argv[3]);
+    const int maxMemory = argc > 4 ? std::atoi(argv[4]) : 64;
+    const int jobs = argc > 5 ? std::atoi(argv[5]) : 4;
+    const qreal Slack = 1.25;
+    const QString directory = QDir::tempPath() +
+            QString("/peakmemory_bench-%1").arg(getpid());
+    if (!QDir().mkpath(directory)) {
+        out << "cannot create " << directory << "\n";
+        return 1;
+    }
+
+    int status;
+    const long baseline = peakKilobytes(diffpdf, QStringList()
+            << "--check" << "--words" << filename1 << filename2, &status);
+    if (baseline < 0 || status > 1) {
+        out << "cannot run " << diffpdf << " --check\n";
+        return 1;
+    }
+    const long limit = baseline + long(maxMemory * 1024 * Slack);
+    out << "baseline (--check --words): " << baseline / 1024 << " MB; "
+        << "limit: " << limit / 1024 << " MB\n";
+
+    const QStringList options = QStringList() << "--visual"
+            << QString("--maxMemory=%1").arg(maxMemory)
+            << QString("--jobs=%1").arg(jobs);
+    QList<QStringList> runs;
+    runs << (QStringList(options) << "--output=" + directory + "/diff.pdf")
+         << (QStringList(options) << "--format=png"
+                                  << "--output=" + directory + "/diff.png");
+    bool ok = true;
+    foreach (const QStringList &run, runs) {
+        const long peak = peakKilobytes(diffpdf, QStringList(run)
+                << filename1 << filename2, &status);
+        const bool passed = peak >= 0 && status == 0 && peak <= limit;
+        out << run.join(" ") << ": " << (peak < 0 ? -1 : peak / 1024)
+            << " MB" << (passed ? "" : " FAILED") << "\n";
+        ok = ok && passed;
+    }
+    foreach (const QString &filename, QDir(directory).entryList(QDir::Files))
+        QFile::remove(directory + "/" + filename);
+    QDir().rmdir(directory);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,10 @@
+# Checks and times findDirtyTiles()'s scanline kernels:
+#   cd bench && qmake tilecompare.pro && make && ./tilecompare_bench
+TEMPLATE      = app
+TARGET        = tilecompare_bench
+CONFIG       += console release
+CONFIG       -= app_bundle
+INCLUDEPATH  += ..
+HEADERS	     += ../tilecompare.hpp
+SOURCES      += ../tilecompare.cpp
+SOURCES      += tilecompare_bench.cpp
@@ -0,0 +1,182 @@
+/*
+    Copyright © 2008-13 Qtrac Ltd. All rights reserved.
+    This program or module is free software: you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 2 of
+    the License, or (at your option) any later version. This program is
+    distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+    for more details.
+*/
+
+// Checks that findDirtyTiles() marks exactly the tiles that comparing
+// QImage::copy()s of every tile does, with each scanline kernel, on
+// random rasters of various sizes, strides, formats and tile sizes; then
+// times each kernel (and the copies) on a letter page at 300 DPI.
+// Exits with 1 if any kernel disagrees with the copies.
+
+#include "tilecompare.hpp"
+#include <QElapsedTimer>
+#include <QImage>
+#include <QTextStream>
+#include <QVector>
+#include <cstdlib>
+
+
+struct Kernel
+{
+    TileKernel kernel;
+    const char *name;
+};
+
+static const Kernel Kernels[] = {{ScalarTileKernel, "scalar"},
+                                 {Sse2TileKernel, "sse2"},
+                                 {Avx2TileKernel, "avx2"}};
+static const int KernelCount = sizeof(Kernels) / sizeof(Kernels[0]);
+
+
+// What computeVisualHighlights() did before findDirtyTiles()
+static DirtyTiles copiedTiles(const QImage &image1, const QImage &image2,
+                              const int squareSize)
+{
+    DirtyTiles tiles;
+    tiles.resize((image1.width() + squareSize - 1) / squareSize,
+                 (image1.height() + squareSize - 1) / squareSize);
+    for (int x = 0; x < image1.width(); x += squareSize) {
+        for (int y = 0; y < image1.height(); y += squareSize) {
+            const QRect rect(x, y, squareSize, squareSize);
+            if (image1.copy(rect) != image2.copy(rect))
+                tiles.setDirty(x / squareSize, y / squareSize);
+        }
+    }
+    return tiles;
+}
+
+
+static bool sameTiles(const DirtyTiles &tiles1, const DirtyTiles &tiles2)
+{
+    if (tiles1.columnCount() != tiles2.columnCount() ||
+        tiles1.rowCount() != tiles2.rowCount())
+        return false;
+    for (int row = 0; row < tiles1.rowCount(); ++row)
+        for (int column = 0; column < tiles1.columnCount(); ++column)
+            if (tiles1.isDirty(column, row) != tiles2.isDirty(column, row))
+                return false;
+    return true;
+}
+
+
+// Makes a pair of rasters over the given buffers (so that the stride can
+// be wider than the image), the second a copy of the first with a number
+// of pixels changed. For RGB32 some changes only touch the undefined
+// alpha byte, which must not count.
+static void makeRasters(const int width, const int height,
+        const int bytesPerLine, const QImage::Format format,
+        const int changes, QVector<uchar> *buffer1, QVector<uchar> *buffer2,
+        QImage *image1, QImage *image2)
+{
+    buffer1->resize(bytesPerLine * height);
+    for (int i = 0; i < buffer1->count(); ++i)
+        (*buffer1)[i] = std::rand() % 4; // mostly equal neighbours
+    *buffer2 = *buffer1;
+    *image1 = QImage(buffer1->data(), width, height, bytesPerLine, format);
+    *image2 = QImage(buffer2->data(), width, height, bytesPerLine, format);
+    for (int i = 0; i < changes; ++i) {
+        const int x = std::rand() % width;
+        const int y = std::rand() % height;
+        quint32 *pixel = reinterpret_cast<quint32*>(image2->scanLine(y)) + x;
+        if (format == QImage::Format_RGB32 && std::rand() % 3 == 0)
+            *pixel ^= 0xFF000000;
+        else
+            *pixel ^= 1u << (std::rand() % 24);
+    }
+}
+
+
+static bool check(QTextStream *out)
+{
+    const QImage::Format Formats[] = {QImage::Format_RGB32,
+            QImage::Format_ARGB32, QImage::Format_ARGB32_Premultiplied};
+    QVector<uchar> buffer1;
+    QVector<uchar> buffer2;
+    QImage image1;
+    QImage image2;
+    int cases = 0;
+    int failures = 0;
+    std::srand(1);
+    for (int i = 0; i < 300; ++i) {
+        const int width = 1 + std::rand() % 200;
+        const int height = 1 + std::rand() % 120;
+        const int bytesPerLine = 4 * (width + std::rand() % 9);
+        const QImage::Format format = Formats[std::rand() % 3];
+        const int squareSize = 1 + std::rand() % 12;
+        makeRasters(width, height, bytesPerLine, format,
+                    std::rand() % 20, &buffer1, &buffer2, &image1, &image2);
+        const DirtyTiles expected = copiedTiles(image1, image2, squareSize);
+        for (int k = 0; k < KernelCount; ++k) {
+            if (!setTileKernel(Kernels[k].kernel))
+                continue;
+            DirtyTiles tiles;
+            ++cases;
+            if (!findDirtyTiles(image1, image2, squareSize, &tiles) ||
+                !sameTiles(tiles, expected)) {
+                ++failures;
+                *out << "MISMATCH: " << Kernels[k].name << " " << width
+                     << "x" << height << " stride " << bytesPerLine
+                     << " format " << format << " squareSize "
+                     << squareSize << "\n";
+            }
+        }
+    }
+    setTileKernel(BestTileKernel);
+    *out << "checked " << cases << " cases: " << failures
+         << " mismatches\n";
+    return failures == 0;
+}
+
+
+static void benchmark(QTextStream *out)
+{
+    const int Width = 2550; // 8.5" x 11" at 300 DPI
+    const int Height = 3300;
+    const int SquareSize = 5;
+    const int Runs = 10;
+    QVector<uchar> buffer1;
+    QVector<uchar> buffer2;
+    QImage image1;
+    QImage image2;
+    makeRasters(Width, Height, Width * 4, QImage::Format_RGB32, 50,
+                &buffer1, &buffer2, &image1, &image2);
+    QElapsedTimer timer;
+    for (int k = 0; k < KernelCount; ++k) {
+        if (!setTileKernel(Kernels[k].kernel)) {
+            *out << Kernels[k].name << ": not supported\n";
+            continue;
+        }
+        qint64 best = -1;
+        for (int run = 0; run < Runs; ++run) {
+            DirtyTiles tiles;
+            timer.start();
+            findDirtyTiles(image1, image2, SquareSize, &tiles);
+            const qint64 elapsed = timer.nsecsElapsed();
+            if (best == -1 || elapsed < best)
+                best = elapsed;
+        }
+        *out << Kernels[k].name << ": " << best / 1000 << " us\n";
+    }
+    setTileKernel(BestTileKernel);
+    timer.start();
+    copiedTiles(image1, image2, SquareSize);
+    *out << "QImage::copy(): " << timer.nsecsElapsed() / 1000 << " us\n";
+}
+
+
+int main()
+{
+    QTextStream out(stdout);
+    if (!check(&out))
+        return 1;
+    benchmark(&out);
+    return 0;
+}
@@ -18,8 +18,20 @@ HEADERS	     += saveform.hpp
 SOURCES      += saveform.cpp
 HEADERS	     += generic.hpp
 SOURCES	     += generic.cpp
+HEADERS	     += ranges.hpp
+SOURCES      += ranges.cpp
+HEADERS	     += fingerprint.hpp
+SOURCES      += fingerprint.cpp
+HEADERS	     += rendercache.hpp
+SOURCES      += rendercache.cpp
+HEADERS	     += textcache.hpp
+SOURCES      += textcache.cpp
+HEADERS	     += tilecompare.hpp
+SOURCES      += tilecompare.cpp
 HEADERS	     += sequence_matcher.hpp
 SOURCES      += sequence_matcher.cpp
+HEADERS	     += myers.hpp
+SOURCES      += myers.cpp
 SOURCES      += main.cpp
 HEADERS	     += lineedit.hpp
 SOURCES	     += lineedit.cpp
@@ -55,15 +67,22 @@ exists($(HOME)/opt/poppler020/) {
 	}
     }
 }
-#exists($(HOME)/opt/podofo09/) {
-#    message(Using locally built PoDoFo library)
-#    INCLUDEPATH += $(HOME)/opt/podofo09/include/poppler/cpp
-#    INCLUDEPATH += $(HOME)/opt/podofo09/include/poppler/qt4
-#    LIBS += -Wl,-rpath -Wl,$(HOME)/opt/podofo09/lib64 -Wl,-L$(HOME)/opt/podofo09/lib64
-#} else {
-#    exists(/usr/include/podofo) {
-#	INCLUDEPATH += /usr/include/podofo
-#    } else {
-#	INCLUDEPATH += /usr/local/include/podofo
-#    }
-#}
+exists($(HOME)/opt/podofo09/) {
+    message(Using locally built PoDoFo library)
+    DEFINES += USE_PODOFO
+    INCLUDEPATH += $(HOME)/opt/podofo09/include
+    LIBS += -Wl,-rpath -Wl,$(HOME)/opt/podofo09/lib64 -Wl,-L$(HOME)/opt/podofo09/lib64
+    LIBS += -lpodofo
+} else {
+    exists(/usr/include/podofo) {
+	DEFINES += USE_PODOFO
+	INCLUDEPATH += /usr/include/podofo
+	LIBS += -lpodofo
+    } else {
+	exists(/usr/local/include/podofo) {
+	    DEFINES += USE_PODOFO
+	    INCLUDEPATH += /usr/local/include/podofo
+	    LIBS += -lpodofo
+	}
+    }
+}
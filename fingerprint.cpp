@@ -0,0 +1,182 @@
+/*
+    Copyright © 2008-13 Qtrac Ltd. All rights reserved.
+    This program or module is free software: you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 2 of
+    the License, or (at your option) any later version. This program is
+    distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+    for more details.
+*/
+
+#include "fingerprint.hpp"
+#include <QCryptographicHash>
+#include <QFile>
+#ifdef USE_PODOFO
+#include <podofo/podofo.h>
+#include <string>
+#endif
+
+
+#ifdef USE_PODOFO
+
+// Keys that link back up (or across) the document's trees; following
+// them would hash most of the document for every page
+static bool isLinkKey(const std::string &key)
+{
+    return key == "Parent" || key == "P" || key == "Prev" ||
+           key == "Next" || key == "First" || key == "Last";
+}
+
+
+Fingerprinter::Fingerprinter(const QString &filename, const QByteArray &data)
+    : document(new PoDoFo::PdfMemDocument)
+{
+    try {
+        if (data.isEmpty())
+            document->Load(QFile::encodeName(filename).constData());
+        else
+            document->Load(data.constData(), data.size());
+    } catch (...) {
+        delete document;
+        document = 0;
+    }
+}
+
+
+Fingerprinter::~Fingerprinter()
+{
+    delete document;
+}
+
+
+bool Fingerprinter::isValid() const
+{
+    return document != 0;
+}
+
+
+const QByteArray Fingerprinter::fingerprint(const int pageNumber)
+{
+    if (!document)
+        return QByteArray();
+    try {
+        PoDoFo::PdfPage *page = document->GetPage(pageNumber);
+        if (!page)
+            return QByteArray();
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        bool cycle = false;
+        const PoDoFo::PdfRect mediaBox = page->GetMediaBox();
+        const PoDoFo::PdfRect cropBox = page->GetCropBox();
+        hash.addData(QString("%1 %2 %3 %4 %5 %6 %7 %8 %9")
+                .arg(mediaBox.GetLeft()).arg(mediaBox.GetBottom())
+                .arg(mediaBox.GetWidth()).arg(mediaBox.GetHeight())
+                .arg(cropBox.GetLeft()).arg(cropBox.GetBottom())
+                .arg(cropBox.GetWidth()).arg(cropBox.GetHeight())
+                .arg(page->GetRotation()).toLatin1());
+        hash.addData("C", 1);
+        addObject(&hash, page->GetContents(), &cycle);
+        hash.addData("R", 1);
+        addObject(&hash, page->GetResources(), &cycle);
+        hash.addData("A", 1);
+        addObject(&hash, page->GetObject()->GetIndirectKey(
+                    PoDoFo::PdfName("Annots")), &cycle);
+        return hash.result();
+    } catch (...) {
+        return QByteArray();
+    }
+}
+
+
+const QByteArray Fingerprinter::digest(const PoDoFo::PdfObject *object,
+                                       bool *cycle)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    addObject(&hash, object, cycle);
+    return hash.result();
+}
+
+
+void Fingerprinter::addObject(QCryptographicHash *hash,
+        const PoDoFo::PdfObject *object, bool *cycle)
+{
+    if (!object) {
+        hash->addData("n", 1);
+        return;
+    }
+    if (object->IsReference()) {
+        const PoDoFo::PdfReference &reference = object->GetReference();
+        const Reference key(reference.ObjectNumber(),
+                            reference.GenerationNumber());
+        if (digestForReference.contains(key)) {
+            hash->addData(digestForReference.value(key));
+            return;
+        }
+        if (inProgress.contains(key)) {
+            // A reference cycle: the object is already being hashed
+            *cycle = true;
+            hash->addData("c", 1);
+            return;
+        }
+        const PoDoFo::PdfObject *target =
+                object->GetOwner()->GetObject(reference);
+        inProgress.insert(key);
+        bool targetCycle = false;
+        const QByteArray targetDigest = digest(target, &targetCycle);
+        inProgress.remove(key);
+        // A digest that was cut short by a cycle depends on where the
+        // hashing started, so it mustn't be reused
+        if (targetCycle)
+            *cycle = true;
+        else
+            digestForReference.insert(key, targetDigest);
+        hash->addData(targetDigest);
+        return;
+    }
+    if (object->IsDictionary()) {
+        hash->addData("<<", 2);
+        const PoDoFo::TKeyMap &keys = object->GetDictionary().GetKeys();
+        for (PoDoFo::TCIKeyMap i = keys.begin(); i != keys.end(); ++i) {
+            const std::string &name = i->first.GetName();
+            hash->addData(name.data(), name.size());
+            if (isLinkKey(name))
+                continue;
+            addObject(hash, i->second, cycle);
+        }
+        hash->addData(">>", 2);
+    }
+    else if (object->IsArray()) {
+        hash->addData("[", 1);
+        const PoDoFo::PdfArray &array = object->GetArray();
+        for (PoDoFo::PdfArray::const_iterator i = array.begin();
+             i != array.end(); ++i)
+            addObject(hash, &*i, cycle);
+        hash->addData("]", 1);
+    }
+    else {
+        std::string data;
+        object->ToString(data);
+        hash->addData(data.data(), data.size());
+    }
+    if (object->HasStream()) {
+        // The raw (still encoded) bytes are enough: equal bytes decode
+        // to equal data, whatever the filters
+        char *buffer = 0;
+        PoDoFo::pdf_long length = 0;
+        const_cast<PoDoFo::PdfObject*>(object)->GetStream()->GetCopy(
+                &buffer, &length);
+        hash->addData("stream", 6);
+        hash->addData(buffer, length);
+        PoDoFo::podofo_free(buffer);
+    }
+}
+
+#else // !USE_PODOFO
+
+Fingerprinter::Fingerprinter(const QString &, const QByteArray &) {}
+Fingerprinter::~Fingerprinter() {}
+bool Fingerprinter::isValid() const { return false; }
+const QByteArray Fingerprinter::fingerprint(const int) { return QByteArray(); }
+
+#endif // USE_PODOFO
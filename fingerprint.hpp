@@ -0,0 +1,67 @@
+#ifndef FINGERPRINT_HPP
+#define FINGERPRINT_HPP
+/*
+    Copyright © 2008-13 Qtrac Ltd. All rights reserved.
+    This program or module is free software: you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 2 of
+    the License, or (at your option) any later version. This program is
+    distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+    for more details.
+*/
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QSet>
+#include <QString>
+
+class QCryptographicHash;
+#ifdef USE_PODOFO
+namespace PoDoFo {
+    class PdfMemDocument;
+    class PdfObject;
+}
+#endif
+
+
+// Hashes everything that determines what a page looks like: its content
+// streams, its resources (fonts, images, forms, ...) followed through
+// all their references, its annotations, and its boxes and rotation.
+// Pages with equal fingerprints render identically, so they can be
+// skipped without being rendered or having their text extracted.
+// Needs PoDoFo; without it (or if PoDoFo can't read the file) every
+// fingerprint is empty, which never matches anything. The document is
+// read from data if that isn't empty, otherwise from filename.
+class Fingerprinter
+{
+public:
+    Fingerprinter(const QString &filename, const QByteArray &data);
+    ~Fingerprinter();
+
+    bool isValid() const;
+    const QByteArray fingerprint(const int pageNumber);
+
+private:
+    Fingerprinter(const Fingerprinter&);
+    Fingerprinter &operator=(const Fingerprinter&);
+
+#ifdef USE_PODOFO
+    typedef QPair<long, int> Reference;
+
+    const QByteArray digest(const PoDoFo::PdfObject *object, bool *cycle);
+    void addObject(QCryptographicHash *hash,
+                   const PoDoFo::PdfObject *object, bool *cycle);
+
+    PoDoFo::PdfMemDocument *document;
+    // Objects such as fonts are shared by many pages, so each object's
+    // digest is only computed once
+    QHash<Reference, QByteArray> digestForReference;
+    QSet<Reference> inProgress;
+#endif
+};
+
+#endif // FINGERPRINT_HPP
@@ -61,16 +61,6 @@ QRectF rectForMargins(const int width, const int height, const int top,
 }
 
 
-Ranges unorderedRange(int end, int start)
-{
-    Q_ASSERT(end >= start);
-    Ranges ranges;
-    while (start < end)
-        ranges.insert(start++);
-    return ranges;
-}
-
-
 QPixmap colorSwatch(const QColor &color)
 {
     QString key = QString("COLORSWATCH:%1").arg(color.name());
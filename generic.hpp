@@ -12,11 +12,11 @@
     for more details.
 */
 
+#include "ranges.hpp"
 #include <poppler-qt4.h>
 #include <QMetaType>
 #include <QPair>
 #include <QPixmap>
-#include <QSet>
 
 class QColor;
 class QMimeData;
@@ -34,13 +34,14 @@ typedef std::tr1::shared_ptr<Poppler::TextBox> PdfTextBox;
 typedef QList<PdfTextBox> TextBoxList;
 
 enum InitialComparisonMode{CompareVisual=0, CompareCharacters=1,
-                           CompareWords=2};
+                           CompareWords=2, CompareWordsThenCharacters=3};
 
 enum Debug{DebugOff, DebugShowTexts, DebugShowTextsAndYX};
 
+enum DiffAlgorithm{DiffLibAlgorithm, MyersAlgorithm};
+
 const int POINTS_PER_INCH = 72;
 
-typedef QSet<int> Ranges;
 typedef QPair<Ranges, Ranges> RangesPair;
 
 struct PagePair
@@ -79,7 +80,6 @@ int pointValueForPixelOffset(const double dpi, int px);
 int pixelOffsetForPointValue(const double dpi, int pt);
 QRectF rectForMargins(const int width, const int height, const int top,
         const int bottom, const int left, const int right);
-Ranges unorderedRange(int end, int start=0);
 
 QPixmap colorSwatch(const QColor &color);
 QPixmap brushSwatch(const Qt::BrushStyle style, const QColor &color);
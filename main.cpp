@@ -12,7 +12,12 @@
 
 #include "mainwindow.hpp"
 #include <QApplication>
+#include <QFile>
 #include <QTextStream>
+#include <QThread>
+
+// The exit codes of --check (also used when a PDF can't be loaded)
+enum ExitCode {ExitSame=0, ExitDifferent=1, ExitError=2};
 
 int main(int argc, char *argv[])
 {
@@ -24,6 +29,8 @@ int main(int argc, char *argv[])
     QString filename2;
     PdfDocument pdf1;
     PdfDocument pdf2;
+    QByteArray data1; // the bytes of pdf1 if it is read from stdin or an fd
+    QByteArray data2;
     QString saveFilename;
     bool printSeparate = false;
     QString pageRangeDoc1;
@@ -51,6 +58,35 @@ int main(int argc, char *argv[])
     int leftMargin = 0;
     int rightMargin = 0;
     int bottomMargin = 0;
+
+    // visual regions smaller than this many square pixels are ignored
+    int minimumArea = 0;
+    // compare at 72 DPI first and only render the changes at zoom DPI
+    bool coarseToFine = false;
+    // how the words or characters are diffed
+    DiffAlgorithm algorithm = DiffLibAlgorithm;
+    // pair up pages by content to cope with inserted and deleted pages
+    bool alignPages = false;
+    // diff the text of the whole document so that reflow isn't a change
+    bool wholeDocument = false;
+    // the resolution of the output images outside the highlighted areas
+    // (0 means the zoom resolution)
+    int outputDpi = 0;
+    // write the diff as PNG images (one per page pair) rather than a PDF
+    bool writePngs = false;
+    // zlib compression level of the PNG images (-1 means Qt's default)
+    int pngCompression = -1;
+    // MB of page rasters to stay within; bigger pages are done in bands
+    // (0 means no limit)
+    int maxMemory = 0;
+    // Put each page's text into reading order before diffing it
+    bool readingOrder = false;
+    // Texts that can't be this percent alike are marked wholly changed
+    // without being diffed (0 means always diff them)
+    int minimumSimilarity = 0;
+
+    // number of page pairs diffed and rendered concurrently
+    int jobs = qMax(1, QThread::idealThreadCount());
     // ====================================
     // END ARGUMENTS
     // ====================================
@@ -61,12 +97,21 @@ int main(int argc, char *argv[])
     // ====================================
     // COMMAND LINE PARSING
     // ====================================
-    QApplication app(argc, argv);
+    // Nothing is ever shown, so don't connect to a display server; this
+    // lets diffpdf run on headless machines without any X or offscreen
+    // setup
+    QApplication app(argc, argv, false);
     QStringList args = app.arguments().mid(1);
     PdfLoader pdfLoader;
     QTextStream out(stdout);
+    // Diagnostics go to stderr so they never end up in a diff or report
+    // written to stdout
+    QTextStream err(stderr);
 
     bool optionsOK = true;
+    bool statistics = false;
+    bool report = false;
+    bool check = false;
     Debug debug = DebugOff;
     foreach (QString arg, args) {
         if (optionsOK && (arg == "--visual" || arg == "-V"))
@@ -75,6 +120,8 @@ int main(int argc, char *argv[])
             comparisonMode = CompareCharacters;
         else if (optionsOK && (arg == "--words" || arg == "-w"))
             comparisonMode = CompareWords;
+        else if (optionsOK && arg == "--wordsThenCharacters")
+            comparisonMode = CompareWordsThenCharacters;
         else if (optionsOK && (arg == "--printSeparate" || arg == "-s"))
             printSeparate = true;
         else if (optionsOK && arg.startsWith("--output="))
@@ -102,7 +149,7 @@ int main(int argc, char *argv[])
                 compositionMode = QPainter::RasterOp_NotSourceXorDestination;
             else
             {
-                out << "invalid value for arg '" << argCopy << "'\n";
+                err << "invalid value for arg '" << argCopy << "'\n";
                 return 0;
             }
         }
@@ -115,7 +162,7 @@ int main(int argc, char *argv[])
             overlap = argCopy.remove(0, 10).toInt(&isInt);
             if (!isInt)
             {
-                out << "value for arg '" << argCopy << "' must be an int.\n";
+                err << "value for arg '" << argCopy << "' must be an int.\n";
                 return 0;
             }
         }
@@ -126,12 +173,12 @@ int main(int argc, char *argv[])
             squareSize = arg.remove(0, 13).toInt(&isInt);
             if (!isInt)
             {
-                out << "value for arg '" << argCopy << "' must be an int.\n";
+                err << "value for arg '" << argCopy << "' must be an int.\n";
                 return 0;
             }
             if (squareSize < 2)
             {
-                out << "Warning: value for arg '" << argCopy << "' recommended to be >= 2.\n";
+                err << "Warning: value for arg '" << argCopy << "' recommended to be >= 2.\n";
             }
         }
         else if (optionsOK && arg.startsWith("--zoom="))
@@ -141,12 +188,12 @@ int main(int argc, char *argv[])
             zoom = arg.remove(0, 7).toInt(&isInt);
             if (!isInt)
             {
-                out << "value for arg '" << argCopy << "' must be an int.\n";
+                err << "value for arg '" << argCopy << "' must be an int.\n";
                 return 0;
             }
             if (zoom < 1 || zoom > 8)
             {
-                out << "Warning: value for arg '" << argCopy << "' should be between 1 and 8.\n";
+                err << "Warning: value for arg '" << argCopy << "' should be between 1 and 8.\n";
             }
         }
         else if (optionsOK && arg.startsWith("--opacity="))
@@ -156,12 +203,12 @@ int main(int argc, char *argv[])
             opacity = arg.remove(0, 10).toInt(&isInt);
             if (!isInt)
             {
-                out << "value for arg '" << argCopy << "' must be an int.\n";
+                err << "value for arg '" << argCopy << "' must be an int.\n";
                 return 0;
             }
             if (opacity < 1 || opacity > 100)
             {
-                out << "Warning: value for arg '" << argCopy << "' should be between 1 and 100.\n";
+                err << "Warning: value for arg '" << argCopy << "' should be between 1 and 100.\n";
             }
         }
         else if (optionsOK && arg.startsWith("--penStyle="))
@@ -182,7 +229,7 @@ int main(int argc, char *argv[])
                 penStyle = Qt::DashDotDotLine;
             else
             {
-                out << "invalid value for arg '" << arg << "'\n";
+                err << "invalid value for arg '" << arg << "'\n";
                 return 0;
             }
         }
@@ -222,7 +269,7 @@ int main(int argc, char *argv[])
                 brushStyle = Qt::DiagCrossPattern;
             else
             {
-                out << "invalid value for arg '" << arg << "'\n";
+                err << "invalid value for arg '" << arg << "'\n";
                 return 0;
             }
         }
@@ -236,7 +283,7 @@ int main(int argc, char *argv[])
             topMargin = arg.remove(0, 12).toInt(&isInt);
             if (!isInt || topMargin < 0)
             {
-                out << "value for arg '" << argCopy << "' must be a positive int.\n";
+                err << "value for arg '" << argCopy << "' must be a positive int.\n";
                 return 0;
             }
         }
@@ -248,7 +295,7 @@ int main(int argc, char *argv[])
             leftMargin = arg.remove(0, 13).toInt(&isInt);
             if (!isInt || leftMargin < 0)
             {
-                out << "value for arg '" << argCopy << "' must be a positive int.\n";
+                err << "value for arg '" << argCopy << "' must be a positive int.\n";
                 return 0;
             }
         }
@@ -260,7 +307,7 @@ int main(int argc, char *argv[])
             rightMargin = arg.remove(0, 14).toInt(&isInt);
             if (!isInt || rightMargin < 0)
             {
-                out << "value for arg '" << argCopy << "' must be a positive int.\n";
+                err << "value for arg '" << argCopy << "' must be a positive int.\n";
                 return 0;
             }
         }
@@ -272,16 +319,134 @@ int main(int argc, char *argv[])
             bottomMargin = arg.remove(0, 15).toInt(&isInt);
             if (!isInt || bottomMargin < 0)
             {
-                out << "value for arg '" << argCopy << "' must be a positive int.\n";
+                err << "value for arg '" << argCopy << "' must be a positive int.\n";
+                return 0;
+            }
+        }
+        else if (optionsOK && arg.startsWith("--minimumArea="))
+        {
+            bool isInt;
+            QString argCopy(arg);
+            minimumArea = arg.remove(0, 14).toInt(&isInt);
+            if (!isInt || minimumArea < 0)
+            {
+                err << "value for arg '" << argCopy << "' must be a non-negative int.\n";
+                return 0;
+            }
+        }
+        else if (optionsOK && arg == "--coarseToFine")
+            coarseToFine = true;
+        else if (optionsOK && arg.startsWith("--algorithm="))
+        {
+            QString argCopy(arg);
+            QString value = argCopy.remove(0, 12);
+            if (value == "difflib")
+                algorithm = DiffLibAlgorithm;
+            else if (value == "myers")
+                algorithm = MyersAlgorithm;
+            else
+            {
+                err << "invalid value for arg '" << arg << "'\n";
+                return 0;
+            }
+        }
+        else if (optionsOK && arg == "--alignPages")
+            alignPages = true;
+        else if (optionsOK && arg == "--wholeDocument")
+            wholeDocument = true;
+        else if (optionsOK && arg.startsWith("--outputDpi="))
+        {
+            bool isInt;
+            QString argCopy(arg);
+            outputDpi = arg.remove(0, 12).toInt(&isInt);
+            if (!isInt || outputDpi < 1)
+            {
+                err << "value for arg '" << argCopy << "' must be a positive int.\n";
                 return 0;
             }
         }
+        else if (optionsOK && arg.startsWith("--format="))
+        {
+            QString argCopy(arg);
+            QString value = arg.remove(0, 9);
+            if (value == "png")
+                writePngs = true;
+            else if (value == "pdf")
+                writePngs = false;
+            else
+            {
+                err << "value for arg '" << argCopy << "' must be png or pdf.\n";
+                return 0;
+            }
+        }
+        else if (optionsOK && arg.startsWith("--pngCompression="))
+        {
+            bool isInt;
+            QString argCopy(arg);
+            pngCompression = arg.remove(0, 17).toInt(&isInt);
+            if (!isInt || pngCompression < 0 || pngCompression > 9)
+            {
+                err << "value for arg '" << argCopy << "' must be between 0 and 9.\n";
+                return 0;
+            }
+        }
+        else if (optionsOK && arg == "--readingOrder")
+            readingOrder = true;
+        else if (optionsOK && arg.startsWith("--minimumSimilarity="))
+        {
+            bool isInt;
+            QString argCopy(arg);
+            minimumSimilarity = arg.remove(0, 20).toInt(&isInt);
+            if (!isInt || minimumSimilarity < 0 || minimumSimilarity > 100)
+            {
+                err << "value for arg '" << argCopy << "' must be between 0 and 100.\n";
+                return 0;
+            }
+        }
+        else if (optionsOK && arg.startsWith("--maxMemory="))
+        {
+            bool isInt;
+            QString argCopy(arg);
+            maxMemory = arg.remove(0, 12).toInt(&isInt);
+            if (!isInt || maxMemory < 0)
+            {
+                err << "value for arg '" << argCopy << "' must be a non-negative int.\n";
+                return 0;
+            }
+        }
+        else if (optionsOK && arg.startsWith("--jobs="))
+        {
+            bool isInt;
+            QString argCopy(arg);
+            jobs = arg.remove(0, 7).toInt(&isInt);
+            if (!isInt || jobs < 1)
+            {
+                err << "value for arg '" << argCopy << "' must be a positive int.\n";
+                return 0;
+            }
+        }
+        else if (optionsOK && arg.startsWith("--report="))
+        {
+            QString argCopy(arg);
+            if (arg.remove(0, 9) != "json")
+            {
+                err << "value for arg '" << argCopy << "' must be json.\n";
+                return 0;
+            }
+            report = true;
+        }
+        else if (optionsOK && arg == "--check")
+            check = true;
+        else if (optionsOK && arg == "--stats")
+            statistics = true;
         else if (optionsOK && (arg == "--help" || arg == "-h")) {
             out << "usage: diffpdf [options] [file1.pdf [file2.pdf]]\n\n"
                 "A GUI program that compares two PDF files and shows "
                 "their differences.\n"
                 "\nThe files are optional and are normally set "
-                "through the user interface.\n\n"
+                "through the user interface. A file can be given as - to "
+                "read it from stdin, or as fd:<n> to read it from the open "
+                "file descriptor n.\n\n"
                 "options:\n"
                 "--help                   -h    show this usage text and terminate "
                 "(run the program without this option and press F1 for "
@@ -292,10 +457,16 @@ int main(int argc, char *argv[])
                 "Characters\n"
                 "--words                  -w    set the initial comparison mode to "
                 "Words\n"
+                "--wordsThenCharacters          compare the words, and then "
+                "the characters of just the words that changed, so that "
+                "e.g., a changed comma is highlighted rather than its whole "
+                "word. With --wholeDocument, the same as --words\n"
                 "--output=<path>                set the output file path for side-"
-                "by-side diffs (printSeparate must not be set)\n"
+                "by-side diffs (printSeparate must not be set). Use - to "
+                "write to stdout\n"
                 "--printSeparate          -s    print the diff for each file "
-                "in a separate file. Printed to <orig_path>.diff.pdf\n"
+                "in a separate file. Printed to <orig_path>.diff.pdf, so "
+                "neither pdf file can be read from a stream\n"
                 "--pageRangeDoc1=<pages>        perform the diff for this "
                 "page range. The format of <pages> is a list of page "
                 "ranges, like 1-20 or 1-3,5,7-9 or even 1,5,9. When "
@@ -334,6 +505,68 @@ int main(int argc, char *argv[])
                 "be excluded from diffs\n"
                 "--bottomMargin=<int>           the size of the bottom margin "
                 "to be excluded from diffs\n"
+                "--minimumArea=<int>            ignore changed regions smaller "
+                "than this many square pixels when using --visual (e.g., "
+                "antialiasing noise). Default 0\n"
+                "--coarseToFine                 with --visual, compare at 72 "
+                "DPI first and only render the changed areas at the "
+                "zoom resolution. Much faster for high zooms, but may "
+                "miss changes too small to show at 72 DPI\n"
+                "--algorithm=<name>             how words or characters are "
+                "diffed: difflib (like Python's difflib) or myers (Myers' "
+                "O(ND) diff; faster on long pages). Default difflib\n"
+                "--alignPages                   pair up the pages by their "
+                "content rather than 1:1, so inserted or deleted pages "
+                "don't make every following page differ. The inserted and "
+                "deleted pages are listed when done. (Use the margin "
+                "options to exclude running headers and page numbers.)\n"
+                "--wholeDocument                with --words or --characters, "
+                "diff the text of all the selected pages in one go, so text "
+                "that only moved onto another page isn't highlighted and "
+                "pages whose only change is reflow are skipped. Pages past "
+                "the end of the shorter document are listed as deleted or "
+                "inserted when done\n"
+                "--outputDpi=<int>              the resolution of the "
+                "written pages outside the highlighted areas, which stay "
+                "at the zoom resolution. Lower values give much smaller "
+                "files. Default the zoom resolution (72 x zoom)\n"
+                "--format=<format>              write the diff as a pdf, or "
+                "as png images numbered after the output path (e.g., "
+                "diff-1.png, diff-2.png, ...). Default pdf\n"
+                "--pngCompression=<int>         the zlib compression level "
+                "of png images, from 0 (fastest) to 9 (smallest)\n"
+                "--readingOrder                 put the text of each page "
+                "into reading order before comparing it: the columns are "
+                "found from the page layout, and the text is read a block "
+                "(e.g., a paragraph) at a time, column by column, with "
+                "text that spans the columns (e.g., a heading) read in "
+                "its place between them. Helps "
+                "with multi-column documents whose PDFs hold the text out "
+                "of order\n"
+                "--minimumSimilarity=<int>      with --words, --characters "
+                "or --wordsThenCharacters, the percentage similarity below "
+                "which a pair of pages is marked as entirely changed "
+                "without diffing its text. Only pages that quick checks "
+                "(of their lengths and their shared words or characters) "
+                "show can't be that similar are skipped, e.g., a replaced "
+                "appendix. Default 0 (always diff)\n"
+                "--maxMemory=<int>              the MB of page images to stay "
+                "within. Pages too big to render whole within it (e.g., A0 "
+                "drawings at high zooms) are compared in bands, and written "
+                "at a lower resolution with the highlighted areas at the "
+                "zoom resolution. Default 0 (no limit)\n"
+                "--jobs=<int>                   the number of page pairs to "
+                "diff and render concurrently. Default the number of cores\n"
+                "--report=json                  write where each pair of "
+                "pages differs (changed word or character rects, or changed "
+                "regions with --visual, in points) as JSON to the --output "
+                "path, or to stdout, instead of rendering a diff\n"
+                "--check                        don't write a diff; just "
+                "exit with 0 if the documents are the same, 1 if they "
+                "differ (stopping at the first difference), or 2 if they "
+                "can't be read\n"
+                "--stats                        print cache statistics when "
+                "done\n"
                 "coordinates in y, x order\n";
                 // TODO(bhuh): Re-enable debug modes
             return 0;
@@ -347,50 +580,84 @@ int main(int argc, char *argv[])
             debug = DebugShowTextsAndYX;
         else if (optionsOK && arg == "--")
             optionsOK = false;
-        else if (filename1.isEmpty() && arg.toLower().endsWith(".pdf"))
+        else if (filename1.isEmpty() && (arg.toLower().endsWith(".pdf") ||
+                                         PdfLoader::isStream(arg)))
         {
             filename1 = arg;
-            pdf1 = pdfLoader.getPdf(filename1);
+            if (PdfLoader::isStream(filename1))
+                data1 = PdfLoader::readStream(filename1);
+            pdf1 = pdfLoader.getPdf(filename1, data1);
             if (!pdf1)
             {
-                out << "invalid pdf file '" << filename1 << "'\n";
-                return 0;
+                err << "invalid pdf file '" << filename1 << "'\n";
+                return ExitError;
             }
         }
-        else if (filename2.isEmpty() && arg.toLower().endsWith(".pdf"))
+        else if (filename2.isEmpty() && (arg.toLower().endsWith(".pdf") ||
+                                         PdfLoader::isStream(arg)))
         {
             filename2 = arg;
-            pdf2 = pdfLoader.getPdf(filename2);
+            if (filename1 == "-" && filename2 == "-")
+            {
+                err << "only one of the pdf files can be read from stdin\n";
+                return ExitError;
+            }
+            if (PdfLoader::isStream(filename2))
+                data2 = PdfLoader::readStream(filename2);
+            pdf2 = pdfLoader.getPdf(filename2, data2);
             if (!pdf2)
             {
-                out << "invalid pdf file '" << filename2 << "'\n";
-                return 0;
+                err << "invalid pdf file '" << filename2 << "'\n";
+                return ExitError;
             }
         }
         else
-            out << "unrecognized argument '" << arg << "'\n";
+            err << "unrecognized argument '" << arg << "'\n";
     }
 
     if (comparisonMode != CompareVisual && useComposition)
     {
-        out << "compositionMode can only be used with --visual argument\n";
+        err << "compositionMode can only be used with --visual argument\n";
         return 0;
     }
-    if (!printSeparate && saveFilename.isEmpty())
+    if (check && (!pdf1 || !pdf2))
     {
-        out << "Must supply an output file if not printing two separate diffs\n";
+        err << "Must supply two pdf files with '--check'\n";
+        return ExitError;
+    }
+    if (report && printSeparate)
+    {
+        err << "Cannot supply '--printSeparate' argument together with '--report' argument\n";
+        return 0;
+    }
+    if (!check && !report && !printSeparate && saveFilename.isEmpty())
+    {
+        err << "Must supply an output file if not printing two separate diffs\n";
+        return 0;
+    }
+    if (writePngs && saveFilename == "-")
+    {
+        err << "Cannot write png images to stdout\n";
         return 0;
     }
     if (printSeparate && !saveFilename.isEmpty())
     {
-        out << "Cannot supply '--printSeparate' argument together with '--output' argument\n";
+        err << "Cannot supply '--printSeparate' argument together with '--output' argument\n";
         return 0;
     }
+    // The separate diffs are named after the pdf files, which a stream
+    // doesn't have
+    if (printSeparate && (PdfLoader::isStream(filename1) ||
+                          PdfLoader::isStream(filename2)))
+    {
+        err << "Cannot supply '--printSeparate' argument when a pdf file is read from a stream\n";
+        return ExitError;
+    }
 
     // TODO(bhuh): do stricter validation of the other params as well
     
-    // flush any warnings to stdout
-    out.flush();
+    // flush any warnings to stderr
+    err.flush();
 
     Differ differ(
         debug,
@@ -399,6 +666,8 @@ int main(int argc, char *argv[])
         filename2,
         pdf1,
         pdf2,
+        data1,
+        data2,
         saveFilename,
         printSeparate,
         pageRangeDoc1,
@@ -418,8 +687,69 @@ int main(int argc, char *argv[])
         topMargin,
         leftMargin,
         rightMargin,
-        bottomMargin);
-    differ.diffToPdfs();
+        bottomMargin,
+        minimumArea,
+        coarseToFine,
+        algorithm,
+        alignPages,
+        wholeDocument,
+        outputDpi,
+        pngCompression,
+        maxMemory,
+        readingOrder,
+        minimumSimilarity,
+        jobs);
+    if (check)
+    {
+        switch (differ.check())
+        {
+            case Differ::CheckSame: return ExitSame;
+            case Differ::CheckDifferent: return ExitDifferent;
+            default:
+                err << "cannot read the pages of '" << filename1 << "' or '"
+                    << filename2 << "'\n";
+                return ExitError;
+        }
+    }
+    // Don't mix the messages into a diff or report written to stdout
+    QTextStream *messages = &out;
+    if (report)
+    {
+        if (saveFilename.isEmpty() || saveFilename == "-")
+        {
+            differ.diffToReport(&out);
+            messages = &err;
+        }
+        else
+        {
+            QFile file(saveFilename);
+            if (!file.open(QIODevice::WriteOnly|QIODevice::Text))
+            {
+                err << "cannot write '" << saveFilename << "': "
+                    << file.errorString() << "\n";
+                return 0;
+            }
+            QTextStream reportOut(&file);
+            reportOut.setCodec("UTF-8");
+            differ.diffToReport(&reportOut);
+        }
+    }
+    else if (writePngs)
+        differ.diffToImages();
+    else
+        differ.diffToPdfs();
+    if (saveFilename == "-")
+        messages = &err;
+    if ((alignPages || wholeDocument) && !report) // the report lists them
+        differ.writePageAlignment(messages);
+    if (statistics)
+        differ.writeStatistics(messages);
+    if (!differ.errors().isEmpty())
+    {
+        foreach (const QString &error, differ.errors())
+            err << error << "\n";
+        return ExitError;
+    }
     return 0;
 }
 
@@ -9,14 +9,112 @@
     FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
     for more details.
 */
+#include "fingerprint.hpp"
 #include "generic.hpp"
 #include "mainwindow.hpp"
+#include "myers.hpp"
 #include "sequence_matcher.hpp"
 #include "textitem.hpp"
+#include "tilecompare.hpp"
 #ifdef DEBUG
 #include <QtDebug>
 #endif
+#include <QCryptographicHash>
+#include <QFile>
+#include <QImageWriter>
+#include <QMutexLocker>
 #include <QPrinter>
+#include <QtConcurrentMap>
+#include <QtConcurrentRun>
+#include <QThreadPool>
+#include <QtCore/qmath.h>
+#include <cstdio>
+
+
+struct Differ::ComparePair
+{
+    typedef Differ::ComparedPair result_type;
+
+    ComparePair(Differ *differ) : differ(differ) {}
+
+    result_type operator()(const int index)
+        { return differ->comparePair(index); }
+
+    Differ *differ;
+};
+
+
+struct Differ::ReportPair
+{
+    typedef Differ::PairReport result_type;
+
+    ReportPair(Differ *differ) : differ(differ) {}
+
+    result_type operator()(const int index)
+        { return differ->reportPair(index); }
+
+    Differ *differ;
+};
+
+
+struct Differ::CheckPair
+{
+    typedef bool result_type;
+
+    CheckPair(Differ *differ, const bool raster)
+        : differ(differ), raster(raster) {}
+
+    result_type operator()(const QPair<int, int> &pages)
+        { return differ->checkPair(pages, raster); }
+
+    Differ *differ;
+    bool raster;
+};
+
+
+struct Differ::CompareBand
+{
+    typedef QList<QRect> result_type;
+
+    CompareBand(Differ *differ, const int left, const int right,
+                const QSize &pageSize)
+        : differ(differ), left(left), right(right), pageSize(pageSize) {}
+
+    result_type operator()(const QRect &band)
+        { return differ->compareBand(left, right, pageSize, band); }
+
+    Differ *differ;
+    int left;
+    int right;
+    QSize pageSize;
+};
+
+
+struct Differ::SignPage
+{
+    typedef QByteArray result_type;
+
+    SignPage(Differ *differ) : differ(differ) {}
+
+    result_type operator()(const QPair<int, int> &page)
+        { return differ->pageSignature(page.first, page.second); }
+
+    Differ *differ;
+};
+
+
+struct Differ::ExtractText
+{
+    typedef TextItems result_type;
+
+    ExtractText(Differ *differ) : differ(differ) {}
+
+    result_type operator()(const QPair<int, int> &page)
+        { return differ->pageTextItems(page.first, page.second); }
+
+    Differ *differ;
+};
+
 
 Differ::Differ(
     const Debug debug,
@@ -25,6 +123,8 @@ Differ::Differ(
     const QString &filename2,
     const PdfDocument &pdf1,
     const PdfDocument &pdf2,
+    const QByteArray &data1,
+    const QByteArray &data2,
     const QString saveFilename,
     const bool printSeparate,
     const QString pageRangeDoc1,
@@ -44,7 +144,20 @@ Differ::Differ(
     const int topMargin,
     const int leftMargin,
     const int rightMargin,
-    const int bottomMargin) : pdf1(pdf1), pdf2(pdf2), debug(debug),
+    const int bottomMargin,
+    const int minimumArea,
+    const bool coarseToFine,
+    const DiffAlgorithm algorithm,
+    const bool alignPages,
+    const bool wholeDocument,
+    const int outputDpi,
+    const int pngCompression,
+    const int maxMemory,
+    const bool readingOrder,
+    const int minimumSimilarity,
+    const int jobs) : pdf1(pdf1), pdf2(pdf2),
+        data1(data1), data2(data2), identicalPages(0),
+        debug(debug),
         comparisonMode(comparisonMode), filename1(filename1),
         filename2(filename2), saveFilename(saveFilename),
         printSeparate(printSeparate), pageRangeDoc1(pageRangeDoc1),
@@ -55,8 +168,22 @@ Differ::Differ(
         penStyle(penStyle), penColor(penColor), brushStyle(brushStyle),
         brushColor(brushColor), margins(margins), topMargin(topMargin),
         leftMargin(leftMargin), rightMargin(rightMargin),
-        bottomMargin(bottomMargin)
+        bottomMargin(bottomMargin), minimumArea(minimumArea),
+        coarseToFine(coarseToFine), algorithm(algorithm),
+        alignPages(alignPages), wholeDocument(wholeDocument),
+        outputDpi(outputDpi), pngCompression(pngCompression),
+        maxMemory(maxMemory), minimumSimilarity(minimumSimilarity),
+        jobs(jobs)
 {
+    if (maxMemory > 0)
+        renderCache.setMaxKilobytes(maxMemory * 1024 / 4);
+    textCache.setReadingOrder(readingOrder);
+    // The documents loaded while parsing the arguments serve the first
+    // worker; any others load their own copies on demand
+    Documents documents = {pdf1, pdf2};
+    freeDocuments << documents;
+    QThreadPool::globalInstance()->setMaxThreadCount(jobs);
+
     const qreal Alpha = opacity / 100.0;
     penColor.setAlphaF(Alpha);
     brushColor.setAlphaF(Alpha);
@@ -68,38 +195,68 @@ Differ::Differ(
     brush.setStyle(brushStyle);
 }
 
-const QPair<QPixmap, QPixmap> Differ::populatePixmaps(
-        const PdfPage &page1, const PdfPage &page2,
-        bool hasVisualDifference)
+Differ::Documents Differ::acquireDocuments()
 {
-    QPixmap pixmap1;
-    QPixmap pixmap2;
+    {
+        QMutexLocker locker(&documentsMutex);
+        if (!freeDocuments.isEmpty())
+            return freeDocuments.takeLast();
+    }
+    PdfLoader pdfLoader;
+    Documents documents;
+    documents.pdf1 = pdfLoader.getPdf(filename1, data1);
+    documents.pdf2 = pdfLoader.getPdf(filename2, data2);
+    return documents;
+}
+
+
+void Differ::releaseDocuments(const Documents &documents)
+{
+    if (!documents.pdf1 || !documents.pdf2)
+        return;
+    QMutexLocker locker(&documentsMutex);
+    freeDocuments << documents;
+}
+
+
+const Differ::PageImages Differ::populateImages(
+        const Documents &documents, const PagePair &pair,
+        const PdfPage &page1, const PdfPage &page2, QList<QRect> *areas1,
+        QList<QRect> *areas2)
+{
+    const bool hasVisualDifference = pair.hasVisualDifference;
+    QImage result1;
+    QImage result2;
     const int DPI = POINTS_PER_INCH * zoom;
     const bool compareText = comparisonMode !=
                              CompareVisual;
+    const bool compareVisually = hasVisualDifference || !compareText;
     QImage plainImage1;
     QImage plainImage2;
-    if (hasVisualDifference || !compareText) {
-        plainImage1 = page1->renderToImage(DPI, DPI);
-        plainImage2 = page2->renderToImage(DPI, DPI);
+    if (compareVisually && !coarseToFine) {
+        plainImage1 = renderCache.render(documents.pdf1, 1, pair.left,
+                page1, DPI, false);
+        plainImage2 = renderCache.render(documents.pdf2, 2, pair.right,
+                page2, DPI, false);
     }
-    pdf1->setRenderHint(Poppler::Document::Antialiasing);
-    pdf1->setRenderHint(Poppler::Document::TextAntialiasing);
-    pdf2->setRenderHint(Poppler::Document::Antialiasing);
-    pdf2->setRenderHint(Poppler::Document::TextAntialiasing);
-    QImage image1 = page1->renderToImage(DPI, DPI);
-    QImage image2 = page2->renderToImage(DPI, DPI);
+    QImage image1 = renderCache.render(documents.pdf1, 1, pair.left, page1,
+            DPI, true);
+    QImage image2 = renderCache.render(documents.pdf2, 2, pair.right, page2,
+            DPI, true);
 
     if (comparisonMode != CompareVisual || !useComposition)
     {
         QPainterPath highlighted1;
         QPainterPath highlighted2;
-        if (hasVisualDifference || !compareText)
+        if (compareVisually && coarseToFine)
+            computeRefinedHighlights(&highlighted1, &highlighted2,
+                    documents, pair, page1, page2, image1.size());
+        else if (compareVisually)
             computeVisualHighlights(&highlighted1, &highlighted2,
                     plainImage1, plainImage2);
         else
-            computeTextHighlights(&highlighted1, &highlighted2, page1,
-                    page2, DPI);
+            computeTextHighlights(&highlighted1, &highlighted2, pair,
+                    page1, page2, DPI);
         if (!highlighted1.isEmpty())
             paintOnImage(highlighted1, &image1);
         if (!highlighted2.isEmpty())
@@ -107,65 +264,417 @@ const QPair<QPixmap, QPixmap> Differ::populatePixmaps(
         if (highlighted1.isEmpty() && highlighted2.isEmpty()) {
             ;
         }
-        pixmap1 = QPixmap::fromImage(image1);
-        pixmap2 = QPixmap::fromImage(image2);
+        if (areas1 && !highlighted1.isEmpty())
+            *areas1 = highlightedAreas(highlighted1, image1.rect());
+        if (areas2 && !highlighted2.isEmpty())
+            *areas2 = highlightedAreas(highlighted2, image2.rect());
+        result1 = image1;
+        result2 = image2;
     } else {
-        pixmap1 = QPixmap::fromImage(image1);
-        QImage composed(image1.size(), image1.format());
-        QPainter painter(&composed);
-        painter.setCompositionMode(QPainter::CompositionMode_Source);
-        painter.fillRect(composed.rect(), Qt::transparent);
-        painter.setCompositionMode(
-                QPainter::CompositionMode_SourceOver);
-        painter.drawImage(0, 0, image1);
-        painter.setCompositionMode(compositionMode);
-        painter.drawImage(0, 0, image2);
-        painter.setCompositionMode(
-                QPainter::CompositionMode_DestinationOver);
-        painter.fillRect(composed.rect(), Qt::white);
-        painter.end();
-        pixmap2 = QPixmap::fromImage(composed);
-    }
-    return qMakePair(pixmap1, pixmap2);
+        result1 = image1;
+        result2 = composeImages(image1, image2);
+    }
+    return qMakePair(result1, result2);
+}
+
+
+const QImage Differ::composeImages(const QImage &image1,
+        const QImage &image2)
+{
+    QImage composed(image1.size(), image1.format());
+    QPainter painter(&composed);
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+    painter.fillRect(composed.rect(), Qt::transparent);
+    painter.setCompositionMode(
+            QPainter::CompositionMode_SourceOver);
+    painter.drawImage(0, 0, image1);
+    painter.setCompositionMode(compositionMode);
+    painter.drawImage(0, 0, image2);
+    painter.setCompositionMode(
+            QPainter::CompositionMode_DestinationOver);
+    painter.fillRect(composed.rect(), Qt::white);
+    painter.end();
+    return composed;
+}
+
+
+// The size in pixels of the page rendered at dpi
+static QSize pixelSize(const PdfPage &page, const int dpi)
+{
+    const QSizeF size = page->pageSizeF();
+    return QSize(qCeil(size.width() * dpi / POINTS_PER_INCH),
+                 qCeil(size.height() * dpi / POINTS_PER_INCH));
+}
+
+
+static qint64 byteCount(const QSize &size)
+{
+    return qint64(size.width()) * size.height() * 4;
+}
+
+
+// The most bytes of page rasters that one page pair may hold at a time
+// (0 for no limit): a quarter of maxMemory is left to the render cache,
+// and the rest is shared by every pair that can be held at once. That's
+// the batch being written and the pending one (jobs pairs each), plus
+// up to jobs pairs waiting to be written as PNGs.
+qint64 Differ::pairBudget() const
+{
+    if (maxMemory <= 0)
+        return 0;
+    const int PairsHeld = 3 * qMax(1, jobs);
+    return qint64(maxMemory) * 1024 * 1024 * 3 / 4 / PairsHeld;
+}
+
+
+// populateImages() holds up to five whole page rasters at the zoom DPI
+bool Differ::needsTiling(const PdfPage &page1, const PdfPage &page2) const
+{
+    const qint64 Budget = pairBudget();
+    if (Budget == 0)
+        return false;
+    const int DPI = POINTS_PER_INCH * zoom;
+    return 5 * qMax(byteCount(pixelSize(page1, DPI)),
+                    byteCount(pixelSize(page2, DPI))) > Budget;
+}
+
+
+// Used instead of populateImages() and prepareForOutput() for pages too
+// big to hold whole at the zoom DPI. The visual differences are found by
+// comparing the pages a band at a time, a few bands at once on the
+// thread pool; the text differences need no rendering at all. The pages
+// are then written at the highest resolution that fits the budget, with
+// each highlighted area (if it fits) as a patch at the zoom DPI; PNGs are
+// written at that resolution too (see saveImage()).
+void Differ::compareTiled(const Documents &documents, const PagePair &pair,
+        const PdfPage &page1, const PdfPage &page2, ComparedPair *compared)
+{
+    const qint64 Budget = pairBudget();
+    const int DPI = POINTS_PER_INCH * zoom;
+    compared->size1 = pixelSize(page1, DPI);
+    compared->size2 = pixelSize(page2, DPI);
+    int baseDpi = outputDpi > 0 ? qMin(outputDpi, DPI) : DPI;
+    const qint64 Bytes = byteCount(compared->size1) +
+                         byteCount(compared->size2);
+    // The pages get a quarter of the budget and the image they're painted
+    // onto when written (as big again) another; the bands and the patches
+    // get a quarter each
+    baseDpi = qMax(1, qMin(baseDpi, int(DPI * qSqrt((Budget / 4.0) /
+                                                     Bytes))));
+    QImage image1 = renderCache.render(documents.pdf1, 1, pair.left, page1,
+            baseDpi, true);
+    QImage image2 = renderCache.render(documents.pdf2, 2, pair.right, page2,
+            baseDpi, true);
+    const bool compareVisually = pair.hasVisualDifference ||
+                                 comparisonMode == CompareVisual;
+    if (comparisonMode == CompareVisual && useComposition)
+        image2 = composeImages(image1, image2);
+    else {
+        QPainterPath highlighted1;
+        QPainterPath highlighted2;
+        if (compareVisually) {
+            foreach (const QRect &region, tiledVisualRegions(pair,
+                        compared->size1, compared->size2, Budget)) {
+                highlighted1.addRect(region);
+                highlighted2.addRect(region);
+            }
+        }
+        else
+            computeTextHighlights(&highlighted1, &highlighted2, pair,
+                    page1, page2, DPI);
+        const QTransform Scale = QTransform::fromScale(
+                baseDpi / qreal(DPI), baseDpi / qreal(DPI));
+        if (!highlighted1.isEmpty()) {
+            paintOnImage(Scale.map(highlighted1), &image1);
+            if (baseDpi < DPI)
+                compared->patches1 = highlightedPatches(documents.pdf1, 1,
+                        pair.left, page1, highlighted1, compared->size1,
+                        Budget);
+        }
+        if (!highlighted2.isEmpty()) {
+            paintOnImage(Scale.map(highlighted2), &image2);
+            if (baseDpi < DPI)
+                compared->patches2 = highlightedPatches(documents.pdf2, 2,
+                        pair.right, page2, highlighted2, compared->size2,
+                        Budget);
+        }
+    }
+    compared->images = qMakePair(
+            image1.convertToFormat(QImage::Format_RGB32),
+            image2.convertToFormat(QImage::Format_RGB32));
+}
+
+
+// Renders the highlighted areas of a page at the zoom DPI, skipping any
+// that are too big for the budget (they still show in the page itself)
+QList<Differ::Patch> Differ::highlightedPatches(const PdfDocument &pdf,
+        const int document, const int pageNumber, const PdfPage &page,
+        const QPainterPath &highlighted, const QSize &size,
+        const qint64 budget)
+{
+    const int DPI = POINTS_PER_INCH * zoom;
+    QList<Patch> patches;
+    qint64 bytes = 0;
+    foreach (const QRect &area, highlightedAreas(highlighted,
+                QRect(QPoint(0, 0), size))) {
+        const qint64 areaBytes = byteCount(area.size());
+        if (area.isEmpty() || bytes + areaBytes > budget / 4)
+            continue;
+        bytes += areaBytes;
+        QImage patch = renderCache.render(pdf, document, pageNumber, page,
+                                          DPI, true, area);
+        paintOnImage(highlighted.translated(-area.topLeft()), &patch);
+        patches << qMakePair(area, patch.convertToFormat(
+                    QImage::Format_RGB32));
+    }
+    return patches;
+}
+
+
+// Compares the two pages a band at a time. The bands cover the area the
+// pages share; whatever lies outside one of the pages (when they differ
+// in size) is a difference. At most MaxBands bands are compared at once,
+// and their rasters take at most a quarter of the budget between them.
+const QList<QRect> Differ::tiledVisualRegions(const PagePair &pair,
+        const QSize &size1, const QSize &size2, const qint64 budget)
+{
+    const int MaxBands = 4;
+    const QSize pageSize = size1.boundedTo(size2);
+    const QSize unitedSize = size1.expandedTo(size2);
+    QList<QRect> regions;
+    if (unitedSize.width() > pageSize.width())
+        regions << QRect(pageSize.width(), 0,
+                         unitedSize.width() - pageSize.width(),
+                         unitedSize.height());
+    if (unitedSize.height() > pageSize.height())
+        regions << QRect(0, pageSize.height(), pageSize.width(),
+                         unitedSize.height() - pageSize.height());
+    if (pageSize.isEmpty())
+        return regions;
+
+    // Each band is rendered once for each page
+    const qint64 BandBytes = qMax(qint64(1), budget / 8 / MaxBands);
+    int bandHeight = int(BandBytes / qMax(qint64(1),
+                                          byteCount(QSize(pageSize.width(), 1))));
+    bandHeight = qMax(squareSize, (bandHeight / squareSize) * squareSize);
+    QList<QRect> bands;
+    for (int y = 0; y < pageSize.height(); y += bandHeight)
+        bands << QRect(0, y, pageSize.width(),
+                       qMin(bandHeight, pageSize.height() - y));
+    for (int i = 0; i < bands.count(); i += MaxBands) {
+        foreach (const QList<QRect> &bandRegions,
+                 QtConcurrent::blockingMapped<QList<QList<QRect> > >(
+                     bands.mid(i, MaxBands),
+                     CompareBand(this, pair.left, pair.right, pageSize)))
+            regions << bandRegions;
+    }
+    return regions;
+}
+
+
+// Runs on a worker thread
+const QList<QRect> Differ::compareBand(const int left, const int right,
+        const QSize &pageSize, const QRect &band)
+{
+    Documents documents = acquireDocuments();
+    if (!documents.pdf1 || !documents.pdf2)
+        return QList<QRect>();
+    const int DPI = POINTS_PER_INCH * zoom;
+    QList<QRect> regions;
+    {
+        PdfPage page1(documents.pdf1->page(left));
+        PdfPage page2(documents.pdf2->page(right));
+        if (page1 && page2) {
+            const QImage image1 = renderCache.render(documents.pdf1, 1,
+                    left, page1, DPI, false, band);
+            const QImage image2 = renderCache.render(documents.pdf2, 2,
+                    right, page2, DPI, false, band);
+            regions = visualRegions(image1, image2, pageSize, DPI,
+                                    band.topLeft());
+        }
+    }
+    releaseDocuments(documents);
+    return regions;
 }
 
 void Differ::computeTextHighlights(QPainterPath *highlighted1,
-        QPainterPath *highlighted2, const PdfPage &page1,
-        const PdfPage &page2, const int DPI)
+        QPainterPath *highlighted2, const PagePair &pair,
+        const PdfPage &page1, const PdfPage &page2, const int DPI)
 {
-    const bool ComparingWords = comparisonMode ==
-                                CompareWords;
-    QRectF rect1;
-    QRectF rect2;
-    QRectF rect;
-    if (margins)
-        rect = pointRectForMargins(page1->pageSize());
-    const TextBoxList list1 = getTextBoxes(page1, rect);
-    const TextBoxList list2 = getTextBoxes(page2, rect);
-    TextItems items1 = ComparingWords ? getWords(list1)
-                                      : getCharacters(list1);
-    TextItems items2 = ComparingWords ? getWords(list2)
-                                      : getCharacters(list2);
+    TextItems items1;
+    TextItems items2;
+    const RangesPair rangesPair = changedTextItems(pair, page1, page2,
+                                                   &items1, &items2);
+    addHighlighting(highlighted1, items1, rangesPair.first, DPI);
+    addHighlighting(highlighted2, items2, rangesPair.second, DPI);
+}
+
+
+// Fills items1 and items2 with the words or characters of the two pages
+// and returns the indexes of those that differ
+RangesPair Differ::changedTextItems(const PagePair &pair,
+        const PdfPage &page1, const PdfPage &page2, TextItems *items1,
+        TextItems *items2)
+{
+    const bool ComparingWords = comparisonMode != CompareCharacters;
+    const QRectF rect1 = textRect(page1);
+    const QRectF rect2 = textRect(page2);
+    if (wholeDocument) {
+        // The document was diffed as a whole, so just look up the
+        // changes that fell on these two pages
+        *items1 = pageTextItems(1, pair.left, page1);
+        *items2 = pageTextItems(2, pair.right, page2);
+        return qMakePair(documentChanges1.value(pair.left),
+                         documentChanges2.value(pair.right));
+    }
+    *items1 = ComparingWords
+            ? textCache.words(1, pair.left, page1, rect1)
+            : textCache.characters(1, pair.left, page1, rect1);
+    *items2 = ComparingWords
+            ? textCache.words(2, pair.right, page2, rect2)
+            : textCache.characters(2, pair.right, page2, rect2);
     const int ToleranceY = 10;
     if (debug >= DebugShowTexts) {
         const bool Yx = debug == DebugShowTextsAndYX;
-        items1.debug(1, ToleranceY, ComparingWords, Yx);
-        items2.debug(2, ToleranceY, ComparingWords, Yx);
+        items1->debug(1, ToleranceY, ComparingWords, Yx);
+        items2->debug(2, ToleranceY, ComparingWords, Yx);
+    }
+    if (comparisonMode == CompareWordsThenCharacters)
+        return refinedTextChanges(textCache.boxes(1, pair.left, page1, rect1),
+                textCache.boxes(2, pair.right, page2, rect2), items1, items2);
+    return diffTexts(*items1, *items2);
+}
+
+
+// Diffs the words, and then the characters of each run of words that was
+// replaced by another, so that a changed comma is highlighted rather than
+// its whole word. Only the replaced words are split into characters;
+// their characters are appended to items1 and items2 after the words,
+// and the returned indexes cover both. (The word items are one per text
+// box, in the same order, so word i's characters come from boxes i.)
+RangesPair Differ::refinedTextChanges(const TextBoxList &boxes1,
+        const TextBoxList &boxes2, TextItems *items1, TextItems *items2)
+{
+    const int count1 = items1->count();
+    const int count2 = items2->count();
+    RangesPair words;
+    RangesPair characters;
+    int i = 0;
+    int j = 0;
+    bool dissimilar = false;
+    QList<Match> matches = matchTexts(*items1, *items2, &dissimilar);
+    if (dissimilar) // so there's nothing worth refining
+        return qMakePair(Ranges(0, count1), Ranges(0, count2));
+    matches << Match(count1, count2, 0);
+    foreach (const Match &match, matches) {
+        if (match.i < i || match.j < j)
+            continue;
+        if (i < match.i && j < match.j)
+            refineReplacement(boxes1, boxes2, i, match.i, j, match.j,
+                              items1, items2, &words, &characters);
+        else {
+            words.first.add(i, match.i);
+            words.second.add(j, match.j);
+        }
+        i = match.i + match.size;
+        j = match.j + match.size;
+    }
+    // The characters' indexes all follow the words', so adding them
+    // after the words keeps the runs in order
+    foreach (const Ranges::Run &run, characters.first.runs())
+        words.first.add(run.start, run.end);
+    foreach (const Ranges::Run &run, characters.second.runs())
+        words.second.add(run.start, run.end);
+    return words;
+}
+
+
+void Differ::refineReplacement(const TextBoxList &boxes1,
+        const TextBoxList &boxes2, const int start1, const int end1,
+        const int start2, const int end2, TextItems *items1,
+        TextItems *items2, RangesPair *words, RangesPair *characters)
+{
+    TextItems characters1;
+    TextItems characters2;
+    for (int index = start1; index < end1 && index < boxes1.count(); ++index)
+        appendCharacters(boxes1.at(index), &characters1);
+    for (int index = start2; index < end2 && index < boxes2.count(); ++index)
+        appendCharacters(boxes2.at(index), &characters2);
+    const RangesPair changes = diffTexts(characters1, characters2);
+    if (changes.first.isEmpty() && changes.second.isEmpty()) {
+        // Only the word breaks changed, so there's no character to point
+        // at; highlight the words themselves
+        words->first.add(start1, end1);
+        words->second.add(start2, end2);
+        return;
+    }
+    const int offset1 = items1->count();
+    const int offset2 = items2->count();
+    foreach (const Ranges::Run &run, changes.first.runs())
+        characters->first.add(offset1 + run.start, offset1 + run.end);
+    foreach (const Ranges::Run &run, changes.second.runs())
+        characters->second.add(offset2 + run.start, offset2 + run.end);
+    items1->append(characters1);
+    items2->append(characters2);
+}
+
+
+// Highlights the items in ranges in index order, so that neighbouring
+// items are combined the same way every time
+void Differ::addHighlighting(QPainterPath *highlighted,
+        const TextItems &items, const Ranges &ranges, const int DPI)
+{
+    QRectF rect;
+    foreach (const Ranges::Run &run, ranges.runs()) {
+        const int end = qMin(run.end, items.count());
+        for (int index = run.start; index < end; ++index)
+            addHighlighting(&rect, highlighted, items.rect(index), DPI);
     }
+    if (!rect.isNull() && !ranges.isEmpty())
+        highlighted->addRect(rect);
+}
 
-    SequenceMatcher matcher(items1.texts(), items2.texts());
-    RangesPair rangesPair = computeRanges(&matcher);
-    rangesPair = invertRanges(rangesPair.first, items1.count(),
-                              rangesPair.second, items2.count());
 
-    foreach (int index, rangesPair.first)
-        addHighlighting(&rect1, highlighted1, items1.at(index).rect, DPI);
-    if (!rect1.isNull() && !rangesPair.first.isEmpty())
-        highlighted1->addRect(rect1);
-    foreach (int index, rangesPair.second)
-        addHighlighting(&rect2, highlighted2, items2.at(index).rect, DPI);
-    if (!rect2.isNull() && !rangesPair.second.isEmpty())
-        highlighted2->addRect(rect2);
+// Returns the indexes of the words or characters that differ
+RangesPair Differ::diffTexts(const TextItems &items1,
+        const TextItems &items2)
+{
+    const RangesPair rangesPair = computeRanges(matchTexts(items1, items2));
+    return invertRanges(rangesPair.first, items1.count(),
+                        rangesPair.second, items2.count());
+}
+
+
+// Returns no matches (and sets dissimilar) without running the matcher
+// if the texts can't be minimumSimilarity percent alike: the quick ratios
+// are upper bounds on the matcher's, so such texts would be mostly
+// changed anyway, and they are the matcher's worst case
+QList<Match> Differ::matchTexts(const TextItems &items1,
+        const TextItems &items2, bool *dissimilar)
+{
+    TokenTable tokens;
+    const Sequence sequence1 = tokens.intern(items1);
+    const Sequence sequence2 = tokens.intern(items2);
+    QList<Match> matches;
+    if (minimumSimilarity > 0) {
+        const double Minimum = minimumSimilarity / 100.0;
+        if (realQuickRatio(sequence1, sequence2) < Minimum ||
+            quickRatio(sequence1, sequence2, tokens.count()) < Minimum) {
+            dissimilarTexts.ref();
+            if (dissimilar)
+                *dissimilar = true;
+            return matches;
+        }
+    }
+    if (algorithm == MyersAlgorithm) {
+        MyersDiff myers(sequence1, sequence2);
+        matches = myers.get_matching_blocks();
+    }
+    else {
+        SequenceMatcher matcher(sequence1, sequence2);
+        matches = matcher.get_matching_blocks();
+    }
+    return matches;
 }
 
 void Differ::addHighlighting(QRectF *bigRect,
@@ -189,38 +698,111 @@ void Differ::addHighlighting(QRectF *bigRect,
 void Differ::computeVisualHighlights(QPainterPath *highlighted1,
         QPainterPath *highlighted2, const QImage &plainImage1,
         const QImage &plainImage2)
+{
+    // Touching tiles are merged into a few regions, so the paths (and
+    // painting them) stay cheap however scattered the changes are
+    foreach (const QRect &region, visualRegions(plainImage1, plainImage2,
+                plainImage1.size(), POINTS_PER_INCH * zoom)) {
+        highlighted1->addRect(region);
+        highlighted2->addRect(region);
+    }
+}
+
+
+// Finds the changed areas on the 72 DPI rasters that getTheDifference()
+// already produced, and then only renders and compares those areas
+// (plus a one point border) at the full zoom DPI
+void Differ::computeRefinedHighlights(QPainterPath *highlighted1,
+        QPainterPath *highlighted2, const Documents &documents,
+        const PagePair &pair, const PdfPage &page1, const PdfPage &page2,
+        const QSize &pageSize)
+{
+    const int DPI = POINTS_PER_INCH * zoom;
+    const QRect coarse = coarseRegion(page1);
+    const QImage coarseImage1 = renderCache.render(documents.pdf1, 1,
+            pair.left, page1, POINTS_PER_INCH, false, coarse);
+    const QImage coarseImage2 = renderCache.render(documents.pdf2, 2,
+            pair.right, page2, POINTS_PER_INCH, false, coarse);
+    DirtyTiles tiles;
+    if (!findDirtyTiles(coarseImage1, coarseImage2, squareSize, &tiles)) {
+        // Can't compare the coarse rasters in place, so do it the long way
+        computeVisualHighlights(highlighted1, highlighted2,
+                renderCache.render(documents.pdf1, 1, pair.left, page1,
+                                   DPI, false),
+                renderCache.render(documents.pdf2, 2, pair.right, page2,
+                                   DPI, false));
+        return;
+    }
+
+    const QPoint origin = coarse.isNull() ? QPoint() : coarse.topLeft();
+    const QRect pageRect(QPoint(0, 0), pageSize);
+    foreach (const QRect &region, dirtyRegions(tiles, squareSize,
+                coarseImage1.rect())) {
+        // At 72 DPI a pixel is a point, so this scales to zoom pixels
+        QRect fine(region.translated(origin).adjusted(-1, -1, 1, 1));
+        fine = QRect(fine.x() * zoom, fine.y() * zoom,
+                     fine.width() * zoom, fine.height() * zoom);
+        // Align to the tile grid so that the tiles are the same as when
+        // comparing the whole page
+        const int left = (fine.left() / squareSize) * squareSize;
+        const int top = (fine.top() / squareSize) * squareSize;
+        fine.setLeft(qMax(0, left));
+        fine.setTop(qMax(0, top));
+        fine = fine.intersected(pageRect);
+        if (fine.isEmpty())
+            continue;
+        const QImage fineImage1 = renderCache.render(documents.pdf1, 1,
+                pair.left, page1, DPI, false, fine);
+        const QImage fineImage2 = renderCache.render(documents.pdf2, 2,
+                pair.right, page2, DPI, false, fine);
+        foreach (const QRect &rect, visualRegions(fineImage1, fineImage2,
+                    pageSize, DPI, fine.topLeft())) {
+            highlighted1->addRect(rect);
+            highlighted2->addRect(rect);
+        }
+    }
+}
+
+
+// Returns the changed regions of the two rasters, which show the part
+// of a page of pageSize pixels (at DPI) starting at origin, in page
+// coordinates
+const QList<QRect> Differ::visualRegions(const QImage &plainImage1,
+        const QImage &plainImage2, const QSize &pageSize, const int DPI,
+        const QPoint &origin)
 {
     QRect box;
     if (margins)
-        box = pixelRectForMargins(plainImage1.size());
-    QRect target;
+        box = pixelRectForMargins(pageSize, DPI);
+    // minimumArea is in square pixels at the zoom DPI
+    const int ZoomDPI = POINTS_PER_INCH * zoom;
+    const int MinimumArea = qRound(minimumArea * (qreal(DPI) / ZoomDPI) *
+                                   (qreal(DPI) / ZoomDPI));
+    DirtyTiles tiles;
+    const bool scanned = findDirtyTiles(plainImage1, plainImage2,
+                                        squareSize, &tiles);
+    if (!scanned)
+        tiles.resize((plainImage1.width() + squareSize - 1) / squareSize,
+                     (plainImage1.height() + squareSize - 1) / squareSize);
     for (int x = 0; x < plainImage1.width(); x += squareSize) {
         for (int y = 0; y < plainImage1.height(); y += squareSize) {
             const QRect rect(x, y, squareSize, squareSize);
-            if (!box.isEmpty() && !box.contains(rect))
-                continue;
-            QImage temp1 = plainImage1.copy(rect);
-            QImage temp2 = plainImage2.copy(rect);
-            if (temp1 != temp2) {
-                if (rect.adjusted(-1, -1, 1, 1).intersects(target))
-                    target = target.united(rect);
-                else {
-                    highlighted1->addRect(target);
-                    highlighted2->addRect(target);
-                    target = rect;
-                }
-            }
+            if (!box.isEmpty() && !box.contains(rect.translated(origin)))
+                tiles.setDirty(x / squareSize, y / squareSize, false);
+            else if (!scanned && plainImage1.copy(rect) !=
+                                 plainImage2.copy(rect))
+                tiles.setDirty(x / squareSize, y / squareSize);
         }
     }
-    if (!target.isNull()) {
-        highlighted1->addRect(target);
-        highlighted2->addRect(target);
-    }
+    QList<QRect> regions;
+    foreach (const QRect &region, dirtyRegions(tiles, squareSize,
+                plainImage1.rect(), MinimumArea))
+        regions << region.translated(origin);
+    return regions;
 }
 
-QRect Differ::pixelRectForMargins(const QSize &size)
+QRect Differ::pixelRectForMargins(const QSize &size, const int DPI)
 {
-    const int DPI = POINTS_PER_INCH * zoom;
     int top = pixelOffsetForPointValue(DPI, topMargin);
     int left = pixelOffsetForPointValue(DPI, leftMargin);
     int right = pixelOffsetForPointValue(DPI, rightMargin);
@@ -230,6 +812,27 @@ QRect Differ::pixelRectForMargins(const QSize &size)
                  QPoint(size.width() - right, size.height() - bottom));
 }
 
+// The parts of an image (within bounds) that paintOnImage() paints over
+const QList<QRect> Differ::highlightedAreas(const QPainterPath &path,
+        const QRect &bounds)
+{
+    const int Border = pen.width() + 1;
+    QList<QRect> areas;
+    QRectF rect = path.boundingRect();
+    if (rect.width() < squareSize && rect.height() < squareSize) {
+        rect.setSize(QSizeF(squareSize, squareSize));
+        areas << rect.toAlignedRect().adjusted(-Border, -Border, Border,
+                                               Border).intersected(bounds);
+    }
+    else {
+        foreach (const QPolygonF &polygon, path.toFillPolygons())
+            areas << polygon.boundingRect().toAlignedRect().adjusted(
+                    -Border, -Border, Border, Border).intersected(bounds);
+    }
+    return areas;
+}
+
+
 void Differ::paintOnImage(const QPainterPath &path, QImage *image)
 {
     QPainter painter(image);
@@ -317,108 +920,684 @@ QList<int> Differ::getPageList(int which, PdfDocument pdf)
 
 void Differ::diffToPdfs()
 {
-    generateDiffStatuses(); // populates diffStatuses
+    generatePagePairs(); // populates pagePairs
     int start = 0;
-    int end = diffStatuses.size();
+    int end = pagePairs.size();
 
+    // With printSeparate both diffs are written in the same pass, so each
+    // page pair is only rendered and diffed once
+    QList<SavePages> saves;
     if (printSeparate)
-    {
-        // TODO(bhuh): there might be a lot of repeated work happening this way.
-        // Investigate.
-        compareAndSaveAsPdfs(start, end, SaveLeftPages);
-        compareAndSaveAsPdfs(start, end, SaveRightPages);
-    }
+        saves << SaveLeftPages << SaveRightPages;
     else
-    {
-        compareAndSaveAsPdfs(start, end, SaveBothPages);
-    }
+        saves << SaveBothPages;
+    compareAndSaveAsPdfs(start, end, saves);
 }
 
 void Differ::diffToImages()
 {
-    generateDiffStatuses(); // populates diffStatuses
+    generatePagePairs(); // populates pagePairs
     int start = 0;
-    int end = diffStatuses.size();
+    int end = pagePairs.size();
 
+    // As for PDFs, both diffs are written in the same pass
+    QList<SavePages> saves;
     if (printSeparate)
-    {
-        // TODO(bhuh): there might be a lot of repeated work happening this way.
-        // Investigate.
-        compareAndSaveAsImages(start, end, SaveLeftPages);
-        compareAndSaveAsImages(start, end, SaveRightPages);
-    }
+        saves << SaveLeftPages << SaveRightPages;
     else
+        saves << SaveBothPages;
+    compareAndSaveAsImages(start, end, saves);
+}
+
+static QString jsonString(const QString &text)
+{
+    QString result("\"");
+    foreach (const QChar c, text) {
+        if (c == '"' || c == '\\')
+            result += QString("\\") + c;
+        else if (c.unicode() < 0x20)
+            result += QString("\\u%1").arg(c.unicode(), 4, 16, QChar('0'));
+        else
+            result += c;
+    }
+    return result + "\"";
+}
+
+
+static QString jsonRects(const QList<QRectF> &rects)
+{
+    QStringList items;
+    foreach (const QRectF &rect, rects)
+        items << QString("[%1, %2, %3, %4]").arg(rect.x()).arg(rect.y())
+                 .arg(rect.width()).arg(rect.height());
+    return "[" + items.join(", ") + "]";
+}
+
+
+// The pages numbered from 1
+static QString jsonPages(const QList<int> &pages)
+{
+    QStringList items;
+    foreach (const int page, pages)
+        items << QString::number(page + 1);
+    return "[" + items.join(", ") + "]";
+}
+
+
+// Writes where each pair of pages differs as JSON, without rendering
+// anything at the zoom DPI: the text modes give the rects of the changed
+// words or characters, and the visual mode gives the changed regions
+// found at 72 DPI. All the coordinates are in points. The pages that
+// alignPages left unpaired are listed too.
+void Differ::diffToReport(QTextStream *out)
+{
+    generatePagePairs(); // populates pagePairs
+    const int end = pagePairs.size();
+    *out << "{\n  \"file1\": " << jsonString(filename1)
+         << ",\n  \"file2\": " << jsonString(filename2)
+         << ",\n  \"mode\": \"" << (comparisonMode == CompareVisual
+                 ? "visual" : comparisonMode == CompareWords ? "words"
+                 : comparisonMode == CompareWordsThenCharacters
+                 ? "wordsThenCharacters" : "characters")
+         << "\",\n  \"pairs\": [";
+    diffStatuses.clear();
+    const int BatchSize = qMax(1, jobs);
+    int written = 0;
+    QFuture<PairReport> pending = reportPairs(0, qMin(BatchSize, end));
+    for (int batchStart = 0; batchStart < end; batchStart += BatchSize) {
+        const QFuture<PairReport> current = pending;
+        const int batchEnd = qMin(batchStart + BatchSize, end);
+        if (batchEnd < end)
+            pending = reportPairs(batchEnd, qMin(batchEnd + BatchSize, end));
+        for (int i = 0; i < batchEnd - batchStart; ++i) {
+            const PairReport report = current.resultAt(i);
+            if (report.difference == NoDifference)
+                continue;
+            const QPair<int, int> &pages = pagePairs.at(batchStart + i);
+            recordDifference(pages, report.difference);
+            *out << (written++ ? ",\n" : "\n")
+                 << "    {\"page1\": " << pages.first + 1
+                 << ", \"page2\": " << pages.second + 1
+                 << ", \"difference\": \""
+                 << (report.difference == VisualDifference ? "visual"
+                                                           : "text")
+                 << "\",\n     \"rects1\": " << jsonRects(report.rects1)
+                 << ",\n     \"rects2\": " << jsonRects(report.rects2)
+                 << "}";
+        }
+    }
+    *out << (written ? "\n  ]" : "]") << ",\n  \"identicalByFingerprint\": "
+         << identicalPages
+         << ",\n  \"deletedPages\": " << jsonPages(deletedPages)
+         << ",\n  \"insertedPages\": " << jsonPages(insertedPages)
+         << "\n}\n";
+    out->flush();
+}
+
+
+QFuture<Differ::PairReport> Differ::reportPairs(const int start,
+        const int end)
+{
+    QList<int> indexes;
+    for (int index = start; index < end; ++index)
+        indexes << index;
+    return QtConcurrent::mapped(indexes, ReportPair(this));
+}
+
+
+// Runs on a worker thread
+Differ::PairReport Differ::reportPair(const int index)
+{
+    const QPair<int, int> &pages = pagePairs.at(index);
+    Documents documents = acquireDocuments();
+    if (!documents.pdf1 || !documents.pdf2)
+        return PairReport();
+    PairReport report;
     {
-        compareAndSaveAsImages(start, end, SaveBothPages);
+        PdfPage page1(documents.pdf1->page(pages.first));
+        PdfPage page2(documents.pdf2->page(pages.second));
+        if (page1 && page2) {
+            const PagePair pair(pages.first, pages.second);
+            if (wholeDocument && comparisonMode != CompareVisual) {
+                if (documentChanges1.contains(pages.first) ||
+                    documentChanges2.contains(pages.second))
+                    report.difference = TextualDifference;
+            }
+            else
+                report.difference = getTheDifference(documents, pages,
+                                                     page1, page2);
+            if (report.difference == NoDifference)
+                ; // nothing to report
+            else if (comparisonMode == CompareVisual) {
+                const QImage image1 = renderCache.render(documents.pdf1, 1,
+                        pages.first, page1, POINTS_PER_INCH, false);
+                const QImage image2 = renderCache.render(documents.pdf2, 2,
+                        pages.second, page2, POINTS_PER_INCH, false);
+                foreach (const QRect &region, visualRegions(image1, image2,
+                            image1.size(), POINTS_PER_INCH)) {
+                    report.rects1 << region;
+                    report.rects2 << region;
+                }
+            }
+            else {
+                TextItems items1;
+                TextItems items2;
+                const RangesPair rangesPair = changedTextItems(pair, page1,
+                        page2, &items1, &items2);
+                report.rects1 = changedRects(items1, rangesPair.first);
+                report.rects2 = changedRects(items2, rangesPair.second);
+            }
+        }
+    }
+    releaseDocuments(documents);
+    return report;
+}
+
+
+QList<QRectF> Differ::changedRects(const TextItems &items,
+        const Ranges &ranges)
+{
+    QList<QRectF> rects;
+    foreach (const Ranges::Run &run, ranges.runs()) {
+        const int end = qMin(run.end, items.count());
+        for (int index = run.start; index < end; ++index)
+            rects << items.rect(index);
     }
+    return rects;
 }
 
-// NOTE(bhuh): Are we doing too much work here? getTheDifference looks
-// like it could be an expensive function, maybe too much work for just
-// deciding whether we want to diff the two pages or not...
-void Differ::generateDiffStatuses()
+
+// Decides which pages are compared with which. Only the steps that need
+// to see every page (aligning the pages, diffing the whole document's
+// text) happen here; the per-pair diffing is left to comparePair() so
+// that it overlaps with rendering and writing.
+void Differ::generatePagePairs()
 {
     QList<int> pages1 = getPageList(1, pdf1);
     QList<int> pages2 = getPageList(2, pdf2);
-    while (!pages1.isEmpty() && !pages2.isEmpty()) {
-        int p1 = pages1.takeFirst();
-        PdfPage page1(pdf1->page(p1));
-        if (!page1) {
-        /**
-         * TODO(bhuh): throw here
-            writeError(tr("Failed to read page %1 from '%2'.")
-                          .arg(p1 + 1).arg(filename1));
-         */
-            continue;
+    if (wholeDocument && comparisonMode != CompareVisual)
+        diffDocuments(pages1, pages2);
+    QList<QPair<int, int> > pairs;
+    if (alignPages)
+        pairs = alignPageLists(pages1, pages2);
+    else {
+        while (!pages1.isEmpty() && !pages2.isEmpty())
+            pairs << qMakePair(pages1.takeFirst(), pages2.takeFirst());
+        // The whole document diff covered the longer document's extra
+        // pages, so they are reported rather than silently dropped
+        if (wholeDocument) {
+            deletedPages << pages1;
+            insertedPages << pages2;
         }
-        int p2 = pages2.takeFirst();
-        PdfPage page2(pdf2->page(p2));
-        if (!page2) {
-        /**
-         * TODO(bhuh): throw here
-            writeError(tr("Failed to read page %1 from '%2'.")
-                          .arg(p2 + 1).arg(filename2));
-         */
-            continue;
+    }
+
+    pagePairs = withoutIdenticalPages(pairs);
+}
+
+
+// Pages with matching fingerprints can't differ, so they are dropped
+// before any text is extracted or anything is rendered
+QList<QPair<int, int> > Differ::withoutIdenticalPages(
+        const QList<QPair<int, int> > &pairs)
+{
+    Fingerprinter fingerprinter1(filename1, data1);
+    Fingerprinter fingerprinter2(filename2, data2);
+    if (!fingerprinter1.isValid() || !fingerprinter2.isValid())
+        return pairs;
+    QList<QPair<int, int> > unmatched;
+    for (int i = 0; i < pairs.count(); ++i) {
+        const QPair<int, int> &pages = pairs.at(i);
+        const QByteArray fingerprint1 = fingerprinter1.fingerprint(
+                pages.first);
+        if (!fingerprint1.isEmpty() && fingerprint1 ==
+                fingerprinter2.fingerprint(pages.second))
+            ++identicalPages;
+        else
+            unmatched << pages;
+    }
+    return unmatched;
+}
+
+
+// Returns whether the documents differ, doing the cheapest checks first
+// (page counts, fingerprints, the text of every pair, and then in visual
+// mode a 72 DPI rendering of every pair) and abandoning all the work
+// that's left as soon as any difference turns up. The pages are paired
+// as they are for a diff, so alignPages and wholeDocument are honored:
+// unpaired pages differ, and with wholeDocument the text is the same
+// only if the whole document diff found no changes.
+Differ::CheckResult Differ::check()
+{
+    if (getPageList(1, pdf1).count() != getPageList(2, pdf2).count())
+        return CheckDifferent;
+    generatePagePairs(); // populates pagePairs
+    if (!deletedPages.isEmpty() || !insertedPages.isEmpty())
+        return CheckDifferent;
+    const QList<QPair<int, int> > &pairs = pagePairs;
+
+    if (wholeDocument && comparisonMode != CompareVisual) {
+        if (!documentChanges1.isEmpty() || !documentChanges2.isEmpty())
+            return CheckDifferent;
+    }
+    else
+        QtConcurrent::blockingMapped<QList<bool> >(pairs,
+                CheckPair(this, false));
+    if (comparisonMode == CompareVisual && !differenceFound)
+        QtConcurrent::blockingMapped<QList<bool> >(pairs,
+                CheckPair(this, true));
+    if (loadFailed)
+        return CheckError;
+    return differenceFound ? CheckDifferent : CheckSame;
+}
+
+
+// Runs on a worker thread; once any pair differs (or can't be read) the
+// rest return at once
+bool Differ::checkPair(const QPair<int, int> &pages, const bool raster)
+{
+    if (differenceFound)
+        return false;
+    Documents documents = acquireDocuments();
+    if (!documents.pdf1 || !documents.pdf2) {
+        loadFailed.fetchAndStoreOrdered(1);
+        differenceFound.fetchAndStoreOrdered(1); // stops the other workers
+        return false;
+    }
+    bool differs = false;
+    {
+        PdfPage page1(documents.pdf1->page(pages.first));
+        PdfPage page2(documents.pdf2->page(pages.second));
+        if (!page1 || !page2) {
+            loadFailed.fetchAndStoreOrdered(1);
+            differenceFound.fetchAndStoreOrdered(1);
         }
-        Difference difference = getTheDifference(page1, page2);
-        if (difference != NoDifference) {
-            QVariant v;
-            v.setValue(PagePair(p1, p2, difference == VisualDifference));
-            diffStatuses.push_back(v);
+        else if (!differenceFound)
+            differs = raster ? rasterDiffers(documents, pages, page1, page2)
+                             : textDiffers(pages, page1, page2);
+    }
+    releaseDocuments(documents);
+    if (differs)
+        differenceFound.fetchAndStoreOrdered(1);
+    return differs;
+}
+
+
+// Called as each compared pair is written, so diffStatuses ends up
+// holding the pairs that differ in page order
+void Differ::recordDifference(const QPair<int, int> &pages,
+        const Difference difference)
+{
+    QVariant v;
+    v.setValue(PagePair(pages.first, pages.second,
+                        difference == VisualDifference));
+    diffStatuses.push_back(v);
+}
+
+
+// Called as each pair is written, for a pair that couldn't be compared
+void Differ::recordUnreadable(const QPair<int, int> &pages)
+{
+    errorMessages << QString("cannot read page %1 of '%2' or page %3 of "
+                             "'%4'").arg(pages.first + 1).arg(filename1)
+                                    .arg(pages.second + 1).arg(filename2);
+}
+
+
+// Diffs the words or characters of all the selected pages of each
+// document in one go, so that text which reflows onto a neighbouring
+// page (e.g., because a sentence was added) isn't seen as a change.
+// The changes are mapped back to the pages they are on.
+void Differ::diffDocuments(const QList<int> &pages1,
+        const QList<int> &pages2)
+{
+    QList<QPair<int, int> > pages; // (document, page)
+    foreach (const int page, pages1)
+        pages << qMakePair(1, page);
+    foreach (const int page, pages2)
+        pages << qMakePair(2, page);
+    const QList<TextItems> pageItems = QtConcurrent::blockingMapped<
+            QList<TextItems> >(pages, ExtractText(this));
+
+    // Each word or character remembers its page and its index on the page
+    TextItems items1;
+    TextItems items2;
+    QList<QPair<int, int> > origins1;
+    QList<QPair<int, int> > origins2;
+    for (int i = 0; i < pageItems.count(); ++i) {
+        const bool first = i < pages1.count();
+        const TextItems &items = pageItems.at(i);
+        for (int j = 0; j < items.count(); ++j)
+            (first ? origins1 : origins2) << qMakePair(pages.at(i).second, j);
+        (first ? items1 : items2).append(items);
+    }
+
+    const RangesPair rangesPair = diffTexts(items1, items2);
+    foreach (const Ranges::Run &run, rangesPair.first.runs()) {
+        for (int index = run.start; index < run.end; ++index) {
+            const QPair<int, int> &origin = origins1.at(index);
+            documentChanges1[origin.first].insert(origin.second);
+        }
+    }
+    foreach (const Ranges::Run &run, rangesPair.second.runs()) {
+        for (int index = run.start; index < run.end; ++index) {
+            const QPair<int, int> &origin = origins2.at(index);
+            documentChanges2[origin.first].insert(origin.second);
         }
     }
 }
 
-Differ::Difference Differ::getTheDifference(PdfPage page1, PdfPage page2)
+
+// Runs on a worker thread
+TextItems Differ::pageTextItems(const int document, const int pageNumber)
 {
-    QRectF rect;
-    if (margins)
-        rect = pointRectForMargins(page1->pageSize());
-    const TextBoxList list1 = getTextBoxes(page1, rect);
-    const TextBoxList list2 = getTextBoxes(page2, rect);
-    if (list1.count() != list2.count())
+    Documents documents = acquireDocuments();
+    if (!documents.pdf1 || !documents.pdf2)
+        return TextItems();
+    TextItems items;
+    {
+        const PdfDocument &pdf = document == 1 ? documents.pdf1
+                                               : documents.pdf2;
+        PdfPage page(pdf->page(pageNumber));
+        if (page)
+            items = pageTextItems(document, pageNumber, page);
+    }
+    releaseDocuments(documents);
+    return items;
+}
+
+
+TextItems Differ::pageTextItems(const int document, const int pageNumber,
+        const PdfPage &page)
+{
+    const QRectF rect = textRect(page);
+    return comparisonMode != CompareCharacters
+            ? textCache.words(document, pageNumber, page, rect)
+            : textCache.characters(document, pageNumber, page, rect);
+}
+
+
+// Pairs up the pages so that pages inserted into (or deleted from) one
+// of the documents don't make every following pair differ. Each page
+// gets a signature from its text and a tiny rendering; the two lists of
+// signatures are aligned with a diff, and the unmatched pages between
+// two matches (e.g., edited pages) are paired up by the similarity of
+// their text (see alignGap()), with any left over reported as deleted
+// (from the first document) or inserted (into the second one).
+QList<QPair<int, int> > Differ::alignPageLists(const QList<int> &pages1,
+        const QList<int> &pages2)
+{
+    QList<QPair<int, int> > pages; // (document, page)
+    foreach (const int page, pages1)
+        pages << qMakePair(1, page);
+    foreach (const int page, pages2)
+        pages << qMakePair(2, page);
+    const QList<QByteArray> signatures = QtConcurrent::blockingMapped<
+            QList<QByteArray> >(pages, SignPage(this));
+    QStringList signatures1;
+    QStringList signatures2;
+    for (int i = 0; i < signatures.count(); ++i) {
+        // Pages that can't be read never match anything
+        const QString signature = signatures.at(i).isEmpty()
+                ? QString("unreadable %1").arg(i)
+                : QString::fromLatin1(signatures.at(i).toHex());
+        if (i < pages1.count())
+            signatures1 << signature;
+        else
+            signatures2 << signature;
+    }
+    TokenTable tokens;
+    const Sequence sequence1 = tokens.intern(signatures1);
+    const Sequence sequence2 = tokens.intern(signatures2);
+    MyersDiff myers(sequence1, sequence2);
+
+    QList<QPair<int, int> > pairs;
+    int i = 0;
+    int j = 0;
+    foreach (const Match &match, myers.get_matching_blocks()) {
+        pairs << alignGap(pages1.mid(i, match.i - i),
+                          pages2.mid(j, match.j - j));
+        i = match.i;
+        j = match.j;
+        for (int k = 0; k < match.size; ++k)
+            pairs << qMakePair(pages1.at(i++), pages2.at(j++));
+    }
+    return pairs;
+}
+
+
+// Pairs up the pages of a gap between two matching pages, keeping them
+// in order and maximizing the total similarity of the pairs, where the
+// similarity is the quick ratio of the pages' words (the share of them
+// the two pages have in common, regardless of order). Pages aren't paired
+// unless they're at least half alike; the rest are deleted or inserted.
+QList<QPair<int, int> > Differ::alignGap(const QList<int> &pages1,
+        const QList<int> &pages2)
+{
+    const double MinimumSimilarity = 0.5;
+    QList<QPair<int, int> > pairs;
+    if (pages1.isEmpty() || pages2.isEmpty()) {
+        deletedPages << pages1;
+        insertedPages << pages2;
+        return pairs;
+    }
+    QList<QPair<int, int> > pages; // (document, page)
+    foreach (const int page, pages1)
+        pages << qMakePair(1, page);
+    foreach (const int page, pages2)
+        pages << qMakePair(2, page);
+    const QList<TextItems> pageItems = QtConcurrent::blockingMapped<
+            QList<TextItems> >(pages, ExtractText(this));
+    TokenTable tokens;
+    QList<Sequence> sequences;
+    foreach (const TextItems &items, pageItems)
+        sequences << tokens.intern(items);
+
+    // scores[i][j] is the best total similarity of the first i pages of
+    // pages1 paired with the first j of pages2
+    const int Count1 = pages1.count();
+    const int Count2 = pages2.count();
+    QVector<QVector<double> > scores(Count1 + 1,
+                                     QVector<double>(Count2 + 1, 0.0));
+    QVector<QVector<double> > similarities(Count1,
+                                           QVector<double>(Count2, 0.0));
+    for (int i = 1; i <= Count1; ++i) {
+        for (int j = 1; j <= Count2; ++j) {
+            const double similarity = quickRatio(sequences.at(i - 1),
+                    sequences.at(Count1 + j - 1), tokens.count());
+            similarities[i - 1][j - 1] = similarity;
+            double score = qMax(scores[i - 1][j], scores[i][j - 1]);
+            if (similarity >= MinimumSimilarity)
+                score = qMax(score, scores[i - 1][j - 1] + similarity);
+            scores[i][j] = score;
+        }
+    }
+    QList<int> deleted;
+    QList<int> inserted;
+    int i = Count1;
+    int j = Count2;
+    while (i > 0 && j > 0) {
+        const double similarity = similarities[i - 1][j - 1];
+        if (similarity >= MinimumSimilarity &&
+            scores[i][j] == scores[i - 1][j - 1] + similarity) {
+            pairs.prepend(qMakePair(pages1.at(i - 1), pages2.at(j - 1)));
+            --i;
+            --j;
+        }
+        else if (scores[i][j] == scores[i - 1][j])
+            deleted.prepend(pages1.at(--i));
+        else
+            inserted.prepend(pages2.at(--j));
+    }
+    while (i > 0)
+        deleted.prepend(pages1.at(--i));
+    while (j > 0)
+        inserted.prepend(pages2.at(--j));
+    deletedPages << deleted;
+    insertedPages << inserted;
+    return pairs;
+}
+
+
+// Runs on a worker thread
+QByteArray Differ::pageSignature(const int document, const int pageNumber)
+{
+    const int ThumbnailDPI = POINTS_PER_INCH / 8;
+    Documents documents = acquireDocuments();
+    if (!documents.pdf1 || !documents.pdf2)
+        return QByteArray();
+    QByteArray signature;
+    {
+        const PdfDocument &pdf = document == 1 ? documents.pdf1
+                                               : documents.pdf2;
+        PdfPage page(pdf->page(pageNumber));
+        if (page) {
+            const QRectF rect = textRect(page);
+            QRect region;
+            if (margins) {
+                region = QRect(
+                    pixelOffsetForPointValue(ThumbnailDPI, rect.x()),
+                    pixelOffsetForPointValue(ThumbnailDPI, rect.y()),
+                    pixelOffsetForPointValue(ThumbnailDPI, rect.width()),
+                    pixelOffsetForPointValue(ThumbnailDPI, rect.height()));
+            }
+            QCryptographicHash hash(QCryptographicHash::Sha1);
+            foreach (const PdfTextBox &box, textCache.boxes(document,
+                        pageNumber, page, rect)) {
+                const QString text = box->text();
+                hash.addData(reinterpret_cast<const char*>(text.utf16()),
+                             (text.size() + 1) * sizeof(ushort));
+            }
+            const QImage thumbnail = renderCache.render(pdf, document,
+                    pageNumber, page, ThumbnailDPI, false, region);
+            hash.addData(reinterpret_cast<const char*>(thumbnail.bits()),
+                         thumbnail.byteCount());
+            signature = hash.result();
+        }
+    }
+    releaseDocuments(documents);
+    return signature;
+}
+
+
+void Differ::writePageAlignment(QTextStream *out) const
+{
+    foreach (const int page, deletedPages)
+        *out << "deleted: page " << page + 1 << " of '" << filename1
+             << "'\n";
+    foreach (const int page, insertedPages)
+        *out << "inserted: page " << page + 1 << " of '" << filename2
+             << "'\n";
+}
+
+
+// Runs on a worker thread: opens, diffs, renders and highlights one page
+// pair, holding the pages and the documents only while it does so
+Differ::ComparedPair Differ::comparePair(const int index)
+{
+    const QPair<int, int> &pages = pagePairs.at(index);
+    ComparedPair compared;
+    Documents documents = acquireDocuments();
+    if (!documents.pdf1 || !documents.pdf2) {
+        compared.loadFailed = true;
+        return compared;
+    }
+    {
+        PdfPage page1(documents.pdf1->page(pages.first));
+        PdfPage page2(documents.pdf2->page(pages.second));
+        if (!page1 || !page2)
+            compared.loadFailed = true;
+        else {
+            if (wholeDocument && comparisonMode != CompareVisual) {
+                // Only pages with changes after the whole document diff
+                // differ; text that merely reflowed doesn't count
+                if (documentChanges1.contains(pages.first) ||
+                    documentChanges2.contains(pages.second))
+                    compared.difference = TextualDifference;
+            }
+            else
+                compared.difference = getTheDifference(documents, pages,
+                                                       page1, page2);
+            if (compared.difference != NoDifference &&
+                needsTiling(page1, page2))
+                compareTiled(documents, PagePair(pages.first, pages.second,
+                             compared.difference == VisualDifference),
+                             page1, page2, &compared);
+            else if (compared.difference != NoDifference) {
+                QList<QRect> areas1;
+                QList<QRect> areas2;
+                compared.images = populateImages(documents,
+                        PagePair(pages.first, pages.second,
+                                 compared.difference == VisualDifference),
+                        page1, page2, &areas1, &areas2);
+                prepareForOutput(&compared, areas1, areas2);
+            }
+        }
+    }
+    releaseDocuments(documents);
+    return compared;
+}
+
+Differ::Difference Differ::getTheDifference(const Documents &documents,
+        const QPair<int, int> &pages, PdfPage page1, PdfPage page2)
+{
+    if (textDiffers(pages, page1, page2))
         return TextualDifference;
+    if (comparisonMode == CompareVisual &&
+        rasterDiffers(documents, pages, page1, page2))
+        return VisualDifference;
+    return NoDifference;
+}
+
+
+bool Differ::textDiffers(const QPair<int, int> &pages,
+        const PdfPage &page1, const PdfPage &page2)
+{
+    const TextBoxList list1 = textCache.boxes(1, pages.first, page1,
+                                              textRect(page1));
+    const TextBoxList list2 = textCache.boxes(2, pages.second, page2,
+                                              textRect(page2));
+    if (list1.count() != list2.count())
+        return true;
     for (int i = 0; i < list1.count(); ++i)
         if (list1[i]->text() != list2[i]->text())
-            return TextualDifference;
-
-    if (comparisonMode == CompareVisual) {
-        int x = -1;
-        int y = -1;
-        int width = -1;
-        int height = -1;
-        if (margins)
-            computeImageOffsets(page1->pageSize(), &x, &y, &width,
-                    &height);
-        QImage image1 = page1->renderToImage(POINTS_PER_INCH,
-                POINTS_PER_INCH, x, y, width, height);
-        QImage image2 = page2->renderToImage(POINTS_PER_INCH,
-                POINTS_PER_INCH, x, y, width, height);
-        if (image1 != image2)
-            return VisualDifference;
-    }
-    return NoDifference;
+            return true;
+    return false;
+}
+
+
+// Compares the pages at 72 DPI
+bool Differ::rasterDiffers(const Documents &documents,
+        const QPair<int, int> &pages, const PdfPage &page1,
+        const PdfPage &page2)
+{
+    const QRect region = coarseRegion(page1);
+    const QImage image1 = renderCache.render(documents.pdf1, 1, pages.first,
+            page1, POINTS_PER_INCH, false, region);
+    const QImage image2 = renderCache.render(documents.pdf2, 2,
+            pages.second, page2, POINTS_PER_INCH, false, region);
+    return image1 != image2;
+}
+
+
+// The part of the page that is rendered at 72 DPI to decide whether a
+// pair of pages differ visually (a null rect for the whole page); it's in
+// 72 DPI pixels, i.e., in points, whatever the zoom
+QRect Differ::coarseRegion(const PdfPage &page)
+{
+    if (!margins)
+        return QRect();
+    return pixelRectForMargins(page->pageSize(), POINTS_PER_INCH);
+}
+
+
+// The rect that every TextCache lookup of the page must use: the cache
+// is keyed by page alone, so the margins are always taken from the
+// page's own size, whichever stage (or pair) asks first
+QRectF Differ::textRect(const PdfPage &page)
+{
+    if (!margins)
+        return QRectF();
+    return pointRectForMargins(page->pageSize());
 }
 
 
@@ -442,91 +1621,198 @@ void Differ::computeImageOffsets(const QSize &size, int *x, int *y,
             (topMargin + bottomMargin));
 }
 
+// Each differing pair is numbered here, in page order, and then composed
+// and PNG-encoded on the thread pool, with at most jobs images waiting to
+// be written. Every image is sized to fit its own pair of pages.
 void Differ::compareAndSaveAsImages(const int start, const int end,
-        const SavePages savePages)
+        const QList<SavePages> &saves)
 {
-    PdfPage page1(pdf1->page(0));
-    if (!page1)
-        return;
-    PdfPage page2(pdf2->page(0));
-    if (!page2)
-        return;
-    // NOTE(bhuh): The following lines are a hack because it assumes all
-    // page sizes are the same for both documents
-    int width = 2 * (savePages == SaveBothPages
-            ? page1->pageSize().width() + page2->pageSize().width()
-            : page1->pageSize().width());
-    // NOTE(bhuh): I'm not sure if I need this...
-    //const int y = fontMetrics().lineSpacing();
-    const int y = 0;
-    const int height = (2 * page1->pageSize().height()) - y;
-    const int gap = 0;
-    const QRect rect(0, 0, width, height);
-    if (savePages == SaveBothPages)
-        width = (width / 2) - gap;
-    const QRect leftRect(0, y, width, height);
-    const QRect rightRect(width + gap, y, width, height);
+    QStringList filenames;
+    foreach (const SavePages savePages, saves)
+        filenames << imageFilename(savePages);
+    diffStatuses.clear();
+    const int BatchSize = qMax(1, jobs);
     int count = 0;
-    QString imageFilename = saveFilename;
-    int i = imageFilename.lastIndexOf(".");
-    if (i > -1)
-        imageFilename.insert(i, "-%1");
-    else
-        imageFilename += "-%1.png";
-    for (int index = start; index < end; ++index) {
-        QImage image(rect.size(), QImage::Format_ARGB32);
-        QPainter painter(&image);
-        painter.fillRect(rect, Qt::white);
-        if (!compareAndPaint(&painter, index, leftRect, rightRect, savePages))
-            continue;
-        QString filename = imageFilename;
-        filename = filename.arg(++count);
-        if (!image.save(filename))
-            ;
-            /**
-             * TODO(bhuh): throw here
-             */
+    QList<QFuture<bool> > writing;
+    QStringList writingFilenames; // the image each of writing is saving
+    QFuture<ComparedPair> pending = comparePairs(start,
+            qMin(start + BatchSize, end));
+    for (int batchStart = start; batchStart < end; batchStart += BatchSize) {
+        const QFuture<ComparedPair> current = pending;
+        const int batchEnd = qMin(batchStart + BatchSize, end);
+        if (batchEnd < end)
+            pending = comparePairs(batchEnd, qMin(batchEnd + BatchSize, end));
+        for (int i = 0; i < batchEnd - batchStart; ++i) {
+            const ComparedPair compared = current.resultAt(i);
+            if (compared.loadFailed)
+                recordUnreadable(pagePairs.at(batchStart + i));
+            if (compared.difference == NoDifference ||
+                compared.images.first.isNull())
+                continue;
+            recordDifference(pagePairs.at(batchStart + i),
+                             compared.difference);
+            ++count;
+            for (int j = 0; j < saves.count(); ++j) {
+                while (writing.count() >= BatchSize)
+                    checkImageSaved(writing.takeFirst(),
+                                    writingFilenames.takeFirst());
+                const QString filename = filenames.at(j).arg(count);
+                writing << QtConcurrent::run(this, &Differ::saveImage,
+                        compared, filename, saves.at(j));
+                writingFilenames << filename;
+            }
+        }
     }
+    while (!writing.isEmpty())
+        checkImageSaved(writing.takeFirst(), writingFilenames.takeFirst());
 }
 
-void Differ::compareAndSaveAsPdfs(const int start, const int end,
+
+// Waits for an image to be written, and records it if it couldn't be
+void Differ::checkImageSaved(QFuture<bool> future, const QString &filename)
+{
+    if (!future.result())
+        errorMessages << QString("cannot write '%1'").arg(filename);
+}
+
+
+// Runs on a worker thread. The image is the size of the prepared page
+// images (so at outputDpi if that was given), not of the pages at the
+// zoom DPI; the zoom DPI patches are scaled down onto it.
+bool Differ::saveImage(const ComparedPair &compared, const QString &filename,
         const SavePages savePages)
 {
-    QPrinter printer(QPrinter::HighResolution);
-    if (savePages == SaveBothPages)
-    {
-        printer.setOutputFileName(saveFilename);
+    const QSize size1 = compared.images.first.size();
+    const QSize size2 = compared.images.second.size();
+    QSize size = savePages == SaveRightPages ? size2 : size1;
+    const QRect leftRect(QPoint(0, 0), size);
+    QRect rightRect;
+    if (savePages == SaveBothPages) {
+        rightRect = QRect(QPoint(size1.width(), 0), size2);
+        size = QSize(size1.width() + size2.width(),
+                     qMax(size1.height(), size2.height()));
     }
-    else if (savePages == SaveLeftPages)
-    {
-        printer.setOutputFileName(filename1 + ".diff.pdf");
+    QImage image(size, QImage::Format_RGB32);
+    QPainter painter(&image);
+    painter.fillRect(image.rect(), Qt::white);
+    paintImages(&painter, compared, leftRect, rightRect, savePages);
+    painter.end();
+    QImageWriter writer(filename, "png");
+    // Qt maps the quality (0-100) onto zlib's compression level (9-0)
+    if (pngCompression >= 0)
+        writer.setQuality(100 - (pngCompression * 91 + 8) / 9);
+    return writer.write(image);
+}
+
+
+// Returns the filename with a %1 for the number of the image
+QString Differ::imageFilename(const SavePages savePages) const
+{
+    QString filename = savePages == SaveBothPages ? saveFilename
+            : savePages == SaveLeftPages ? filename1 + ".diff.png"
+            : filename2 + ".diff.png";
+    const int i = filename.lastIndexOf(".");
+    if (i > -1 && i > filename.lastIndexOf("/"))
+        filename.insert(i, "-%1");
+    else
+        filename += "-%1.png";
+    return filename;
+}
+
+void Differ::compareAndSaveAsPdfs(const int start, const int end,
+        const QList<SavePages> &saves)
+{
+    // NOTE(bhuh): The following lines are a hack because it assumes all
+    // page sizes are the same for both documents
+    QSizeF singlePage;
+    {   // Don't hold on to a page of pdf1 while the workers use it
+        PdfPage page(pdf1->page(0));
+        singlePage = page->pageSizeF();
     }
-    else // savePages == saveRightPages
-    {
-        printer.setOutputFileName(filename2 + ".diff.pdf");
+    QList<PdfOutput*> outputs;
+    foreach (const SavePages savePages, saves)
+        outputs << new PdfOutput(outputFilename(savePages), singlePage,
+                                 savePages);
+
+    // The pairs flow through in batches of jobs: each worker opens,
+    // diffs, renders and highlights a pair, while the previous batch is
+    // being painted and written in page order. At most two batches are in
+    // flight, so memory stays the same however long the documents are,
+    // and each compared pair goes to every output.
+    diffStatuses.clear();
+    const int BatchSize = qMax(1, jobs);
+    int written = 0;
+    QFuture<ComparedPair> pending = comparePairs(start,
+            qMin(start + BatchSize, end));
+    for (int batchStart = start; batchStart < end; batchStart += BatchSize) {
+        const QFuture<ComparedPair> current = pending;
+        const int batchEnd = qMin(batchStart + BatchSize, end);
+        if (batchEnd < end)
+            pending = comparePairs(batchEnd, qMin(batchEnd + BatchSize, end));
+        for (int i = 0; i < batchEnd - batchStart; ++i) {
+            const ComparedPair compared = current.resultAt(i);
+            if (compared.loadFailed)
+                recordUnreadable(pagePairs.at(batchStart + i));
+            if (compared.difference == NoDifference ||
+                compared.images.first.isNull())
+                continue;
+            recordDifference(pagePairs.at(batchStart + i),
+                             compared.difference);
+            foreach (PdfOutput *output, outputs) {
+                if (written)
+                    output->printer.newPage();
+                paintImages(&output->painter, compared, output->leftRect,
+                        output->rightRect, output->savePages);
+            }
+            ++written;
+        }
     }
+    foreach (PdfOutput *output, outputs)
+        if (!output->finish())
+            errorMessages << QString("cannot write '%1'")
+                                     .arg(output->filename);
+    qDeleteAll(outputs);
+}
+
+
+QString Differ::outputFilename(const SavePages savePages) const
+{
+    if (savePages == SaveBothPages)
+        return saveFilename;
+    else if (savePages == SaveLeftPages)
+        return filename1 + ".diff.pdf";
+    return filename2 + ".diff.pdf"; // savePages == SaveRightPages
+}
+
 
+PdfOutput::PdfOutput(const QString &filename, const QSizeF &singlePage,
+        const SavePages savePages)
+    : filename(filename), printer(QPrinter::HighResolution),
+      savePages(savePages)
+{
+    if (filename == "-" && spool.open()) {
+        spool.close();
+        printer.setOutputFileName(spool.fileName());
+    }
+    else
+        printer.setOutputFileName(filename);
     printer.setOutputFormat(QPrinter::PdfFormat);
     printer.setColorMode(QPrinter::Color);
     printer.setFullPage(true);
 
-    // NOTE(bhuh): The following lines are a hack because it assumes all
-    // page sizes are the same for both documents
-    PdfPage page(pdf1->page(0));
     const int gap = 0;
     QSizeF printPageSize;
     if (savePages == SaveBothPages)
     {
-        QSizeF singlePage(page->pageSizeF());
         printPageSize = QSizeF(singlePage.width()*2 + gap, singlePage.height());
     }
     else
     {
-        printPageSize = QSizeF(page->pageSizeF());
+        printPageSize = singlePage;
     }
     printer.setPaperSize(printPageSize, QPrinter::Point);
 
-    QPainter painter(&printer);
+    painter.begin(&printer);
     // NOTE(bhuh): I'm not sure if I need this...
     //const int y = painter.fontMetrics().lineSpacing();
     const int y = 0;
@@ -534,51 +1820,130 @@ void Differ::compareAndSaveAsPdfs(const int start, const int end,
     int width = (painter.viewport().width()-gap) / 2;
     if (savePages != SaveBothPages)
         width = painter.viewport().width();
-    const QRect leftRect(0, y, width, height);
-    const QRect rightRect(width + gap, y, width, height);
-    for (int index = start; index < end; ++index) {
-        if (!compareAndPaint(&painter, index, leftRect, rightRect, savePages))
-            continue;
-        if (index + 1 < end)
-            printer.newPage();
+    leftRect = QRect(0, y, width, height);
+    rightRect = QRect(width + gap, y, width, height);
+}
+
+
+bool PdfOutput::finish()
+{
+    if (!painter.end() || printer.printerState() == QPrinter::Error)
+        return false;
+    if (filename != "-")
+        return true;
+    QFile in(spool.fileName());
+    QFile out;
+    if (!in.open(QIODevice::ReadOnly) ||
+        !out.open(fileno(stdout), QIODevice::WriteOnly))
+        return false;
+    while (!in.atEnd()) {
+        const QByteArray chunk = in.read(1024 * 1024);
+        if (chunk.isEmpty() || out.write(chunk) != chunk.size())
+            return false;
     }
+    return out.flush();
+}
+
+
+QFuture<Differ::ComparedPair> Differ::comparePairs(const int start,
+        const int end)
+{
+    QList<int> indexes;
+    for (int index = start; index < end; ++index)
+        indexes << index;
+    return QtConcurrent::mapped(indexes, ComparePair(this));
 }
 
-bool Differ::compareAndPaint(QPainter *painter, const int index,
+
+// Runs on a worker thread. The images are made opaque, so that the PDF
+// engine doesn't scan them for a soft mask, and when outputDpi is below
+// the zoom DPI they are scaled down, with the highlighted areas kept as
+// patches at the full resolution to be drawn on top.
+void Differ::prepareForOutput(ComparedPair *compared,
+        const QList<QRect> &areas1, const QList<QRect> &areas2)
+{
+    QImage &image1 = compared->images.first;
+    QImage &image2 = compared->images.second;
+    compared->size1 = image1.size();
+    compared->size2 = image2.size();
+    if (image1.format() != QImage::Format_RGB32)
+        image1 = image1.convertToFormat(QImage::Format_RGB32);
+    if (image2.format() != QImage::Format_RGB32)
+        image2 = image2.convertToFormat(QImage::Format_RGB32);
+    const int DPI = POINTS_PER_INCH * zoom;
+    if (outputDpi <= 0 || outputDpi >= DPI)
+        return;
+    foreach (const QRect &area, areas1)
+        compared->patches1 << qMakePair(area, image1.copy(area));
+    foreach (const QRect &area, areas2)
+        compared->patches2 << qMakePair(area, image2.copy(area));
+    const qreal Scale = outputDpi / qreal(DPI);
+    image1 = image1.scaled(qMax(1, qRound(image1.width() * Scale)),
+            qMax(1, qRound(image1.height() * Scale)), Qt::IgnoreAspectRatio,
+            Qt::SmoothTransformation);
+    image2 = image2.scaled(qMax(1, qRound(image2.width() * Scale)),
+            qMax(1, qRound(image2.height() * Scale)), Qt::IgnoreAspectRatio,
+            Qt::SmoothTransformation);
+}
+
+
+void Differ::paintImages(QPainter *painter, const ComparedPair &compared,
         const QRect &leftRect, const QRect &rightRect,
         const SavePages savePages)
 {
-    PagePair pair = diffStatuses[index].value<PagePair>();
-    if (pair.isNull())
-        return false;
-    PdfPage page1(pdf1->page(pair.left));
-    if (!page1)
-        return false;
-    PdfPage page2(pdf2->page(pair.right));
-    if (!page2)
-        return false;
-    const QPair<QPixmap, QPixmap> pixmaps = populatePixmaps(page1,
-        page2, pair.hasVisualDifference);
+    // The images are drawn as they are; converting them to pixmaps would
+    // copy them and would need a display server
     if (savePages == SaveBothPages) {
-        QRect rect = resizeRect(leftRect, pixmaps.first.size());
-        painter->drawPixmap(rect, pixmaps.first);
-        rect = resizeRect(rightRect, pixmaps.second.size());
-        painter->drawPixmap(rect, pixmaps.second);
+        paintImage(painter, leftRect, compared.images.first,
+                   compared.size1, compared.patches1);
+        paintImage(painter, rightRect, compared.images.second,
+                   compared.size2, compared.patches2);
         painter->drawRect(rightRect.adjusted(2.5, 2.5, 2.5, 2.5));
     } else if (savePages == SaveLeftPages) {
-        QRect rect = resizeRect(leftRect, pixmaps.first.size());
-        painter->drawPixmap(rect, pixmaps.first);
+        paintImage(painter, leftRect, compared.images.first,
+                   compared.size1, compared.patches1);
     } else { // (savePages == SaveRightPages)
-        QRect rect = resizeRect(leftRect, pixmaps.second.size());
-        painter->drawPixmap(rect, pixmaps.second);
+        paintImage(painter, leftRect, compared.images.second,
+                   compared.size2, compared.patches2);
     }
-    return true;
+}
+
+
+// Draws an image that was size pixels when rendered (it may since have
+// been scaled down) and then its full resolution patches over it. The
+// PDF engine embeds each image at its own size, so nothing is resampled.
+void Differ::paintImage(QPainter *painter, const QRect &pageRect,
+        const QImage &image, const QSize &size, const QList<Patch> &patches)
+{
+    const QRect rect = resizeRect(pageRect, size);
+    painter->drawImage(rect, image);
+    const qreal ScaleX = rect.width() / qreal(size.width());
+    const qreal ScaleY = rect.height() / qreal(size.height());
+    foreach (const Patch &patch, patches) {
+        const QRect &area = patch.first;
+        painter->drawImage(QRectF(rect.x() + area.x() * ScaleX,
+                    rect.y() + area.y() * ScaleY, area.width() * ScaleX,
+                    area.height() * ScaleY), patch.second);
+    }
+}
+
+void Differ::writeStatistics(QTextStream *out) const
+{
+    *out << "render cache: " << renderCache.hits() << " hits, "
+         << renderCache.misses() << " misses\n";
+    *out << "text cache: " << textCache.hits() << " hits, "
+         << textCache.misses() << " misses\n";
+    *out << "pages skipped by fingerprint: " << identicalPages << "\n";
+    *out << "texts too dissimilar to diff: " << int(dissimilarTexts)
+         << "\n";
 }
 
 PdfLoader::PdfLoader() {}
-PdfDocument PdfLoader::getPdf(const QString &filename)
+PdfDocument PdfLoader::getPdf(const QString &filename,
+        const QByteArray &data)
 {
-    PdfDocument pdf(Poppler::Document::load(filename));
+    PdfDocument pdf(data.isEmpty() ? Poppler::Document::load(filename)
+                                   : Poppler::Document::loadFromData(data));
     if (!pdf)
     /**
      * TODO(bhuh): Throw here
@@ -601,3 +1966,25 @@ PdfDocument PdfLoader::getPdf(const QString &filename)
     }
     return pdf;
 }
+
+
+bool PdfLoader::isStream(const QString &filename)
+{
+    return filename == "-" || filename.startsWith("fd:");
+}
+
+
+QByteArray PdfLoader::readStream(const QString &filename)
+{
+    int fd = 0; // stdin
+    if (filename != "-") {
+        bool ok;
+        fd = filename.mid(3).toInt(&ok);
+        if (!ok || fd < 0)
+            return QByteArray();
+    }
+    QFile file;
+    if (!file.open(fd, QIODevice::ReadOnly))
+        return QByteArray();
+    return file.readAll();
+}
@@ -13,20 +13,59 @@
 */
 
 #include "generic.hpp"
+#include "rendercache.hpp"
 #include "saveform.hpp"
+#include "textcache.hpp"
 #include <poppler-qt4.h>
+#include <QAtomicInt>
 #include <QBrush>
+#include <QFuture>
+#include <QHash>
+#include <QImage>
 #include <QList>
+#include <QMutex>
 #include <QPainter>
 #include <QPen>
+#include <QPrinter>
+#include <QStringList>
+#include <QTemporaryFile>
 #include <QVector>
 
+class QTextStream;
+struct Match;
+
 // TODO(bhuh): find a better home for this class
+// A filename of "-" means stdin and "fd:<n>" means the already open file
+// descriptor n. These can only be read once, so readStream() reads their
+// bytes up front and every copy of the document is loaded from them.
 class PdfLoader
 {
 public:
     PdfLoader();
-    PdfDocument getPdf(const QString &filename);
+    PdfDocument getPdf(const QString &filename,
+                       const QByteArray &data=QByteArray());
+
+    static bool isStream(const QString &filename);
+    static QByteArray readStream(const QString &filename);
+};
+
+// One PDF being written; with --printSeparate there is one per document.
+// QPrinter can only write to a named file, so a PDF for stdout ("-") is
+// spooled to a temporary file and copied to stdout by finish().
+struct PdfOutput
+{
+    PdfOutput(const QString &filename, const QSizeF &singlePage,
+              const SavePages savePages);
+
+    bool finish();
+
+    const QString filename;
+    QTemporaryFile spool;
+    QPrinter printer;
+    QPainter painter;
+    const SavePages savePages;
+    QRect leftRect;
+    QRect rightRect;
 };
 
 class Differ
@@ -39,6 +78,8 @@ public:
         const QString &filename2,
         const PdfDocument &pdf1,
         const PdfDocument &pdf2,
+        const QByteArray &data1,
+        const QByteArray &data2,
         const QString saveFilename,
         const bool printSeparate,
         const QString pageRangeDoc1,
@@ -58,46 +99,197 @@ public:
         const int topMargin,
         const int leftMargin,
         const int rightMargin,
-        const int bottomMargin);
+        const int bottomMargin,
+        const int minimumArea,
+        const bool coarseToFine,
+        const DiffAlgorithm algorithm,
+        const bool alignPages,
+        const bool wholeDocument,
+        const int outputDpi,
+        const int pngCompression,
+        const int maxMemory,
+        const bool readingOrder,
+        const int minimumSimilarity,
+        const int jobs);
 
     void diffToPdfs();
     void diffToImages();
+    void diffToReport(QTextStream *out);
+    enum CheckResult{CheckSame, CheckDifferent, CheckError};
+    CheckResult check();
+    void writeStatistics(QTextStream *out) const;
+    void writePageAlignment(QTextStream *out) const;
+    // Why the diff is incomplete (e.g., pages that couldn't be read)
+    const QStringList &errors() const { return errorMessages; }
 protected:
 
 private:
     enum Difference {NoDifference, TextualDifference, VisualDifference};
 
-    void generateDiffStatuses();
+    // Poppler documents are not thread-safe, so every worker borrows a
+    // pair of documents of its own for as long as it works on a page pair
+    struct Documents
+    {
+        PdfDocument pdf1;
+        PdfDocument pdf2;
+    };
+    typedef QPair<QImage, QImage> PageImages;
+    typedef QPair<QRect, QImage> Patch; // a full resolution area
+    struct ComparedPair
+    {
+        ComparedPair() : difference(NoDifference), loadFailed(false) {}
+
+        Difference difference;
+        bool loadFailed; // the documents or the pages couldn't be read
+        PageImages images; // null if there is no difference
+        QSize size1; // the sizes of the images as rendered
+        QSize size2;
+        QList<Patch> patches1; // only if the images were scaled down
+        QList<Patch> patches2;
+    };
+    struct ComparePair;
+    struct PairReport
+    {
+        PairReport() : difference(NoDifference) {}
+
+        Difference difference;
+        QList<QRectF> rects1; // in points
+        QList<QRectF> rects2;
+    };
+    struct ReportPair;
+    struct CheckPair;
+    struct CompareBand;
+    struct SignPage;
+    struct ExtractText;
+
+    Documents acquireDocuments();
+    void releaseDocuments(const Documents &documents);
+    void generatePagePairs();
+    QList<QPair<int, int> > withoutIdenticalPages(
+            const QList<QPair<int, int> > &pairs);
+    bool checkPair(const QPair<int, int> &pages, const bool raster);
+    void recordDifference(const QPair<int, int> &pages,
+            const Difference difference);
+    void recordUnreadable(const QPair<int, int> &pages);
+    QList<QPair<int, int> > alignPageLists(const QList<int> &pages1,
+            const QList<int> &pages2);
+    QList<QPair<int, int> > alignGap(const QList<int> &pages1,
+            const QList<int> &pages2);
+    QByteArray pageSignature(const int document, const int pageNumber);
+    void diffDocuments(const QList<int> &pages1, const QList<int> &pages2);
+    TextItems pageTextItems(const int document, const int pageNumber);
+    TextItems pageTextItems(const int document, const int pageNumber,
+            const PdfPage &page);
+    RangesPair diffTexts(const TextItems &items1, const TextItems &items2);
+    QList<Match> matchTexts(const TextItems &items1,
+            const TextItems &items2, bool *dissimilar=0);
+    RangesPair refinedTextChanges(const TextBoxList &boxes1,
+            const TextBoxList &boxes2, TextItems *items1,
+            TextItems *items2);
+    void refineReplacement(const TextBoxList &boxes1,
+            const TextBoxList &boxes2, const int start1, const int end1,
+            const int start2, const int end2, TextItems *items1,
+            TextItems *items2, RangesPair *words, RangesPair *characters);
     QList<int> getPageList(int which, PdfDocument pdf);
-    Difference getTheDifference(PdfPage page1, PdfPage page2);
+    ComparedPair comparePair(const int index);
+    QFuture<PairReport> reportPairs(const int start, const int end);
+    PairReport reportPair(const int index);
+    QList<QRectF> changedRects(const TextItems &items, const Ranges &ranges);
+    Difference getTheDifference(const Documents &documents,
+            const QPair<int, int> &pages, PdfPage page1, PdfPage page2);
+    bool textDiffers(const QPair<int, int> &pages, const PdfPage &page1,
+            const PdfPage &page2);
+    bool rasterDiffers(const Documents &documents,
+            const QPair<int, int> &pages, const PdfPage &page1,
+            const PdfPage &page2);
+    const QList<QRect> highlightedAreas(const QPainterPath &path,
+            const QRect &bounds);
     void paintOnImage(const QPainterPath &path, QImage *image);
-    const QPair<QPixmap, QPixmap> populatePixmaps(const PdfPage &page1,
-            const PdfPage &page2, bool hasVisualDifference);
+    const PageImages populateImages(const Documents &documents,
+            const PagePair &pair, const PdfPage &page1,
+            const PdfPage &page2, QList<QRect> *areas1=0,
+            QList<QRect> *areas2=0);
     void computeTextHighlights(QPainterPath *highlighted1,
-            QPainterPath *highlighted2, const PdfPage &page1,
-            const PdfPage &page2, const int DPI);
+            QPainterPath *highlighted2, const PagePair &pair,
+            const PdfPage &page1, const PdfPage &page2, const int DPI);
+    RangesPair changedTextItems(const PagePair &pair, const PdfPage &page1,
+            const PdfPage &page2, TextItems *items1, TextItems *items2);
     void computeVisualHighlights(QPainterPath *highlighted1,
         QPainterPath *highlighted2, const QImage &plainImage1,
         const QImage &plainImage2);
+    void computeRefinedHighlights(QPainterPath *highlighted1,
+        QPainterPath *highlighted2, const Documents &documents,
+        const PagePair &pair, const PdfPage &page1, const PdfPage &page2,
+        const QSize &pageSize);
+    const QList<QRect> visualRegions(const QImage &plainImage1,
+        const QImage &plainImage2, const QSize &pageSize, const int DPI,
+        const QPoint &origin=QPoint());
     void addHighlighting(QRectF *bigRect, QPainterPath *highlighted,
             const QRectF wordOrCharRect, const int DPI);
+    void addHighlighting(QPainterPath *highlighted, const TextItems &items,
+            const Ranges &ranges, const int DPI);
     void compareAndSaveAsPdfs(const int start, const int end,
-            const SavePages savePages);
-    bool compareAndPaint(QPainter *painter, const int index,
+            const QList<SavePages> &saves);
+    QString outputFilename(const SavePages savePages) const;
+    QFuture<ComparedPair> comparePairs(const int start, const int end);
+    const QImage composeImages(const QImage &image1, const QImage &image2);
+    qint64 pairBudget() const;
+    bool needsTiling(const PdfPage &page1, const PdfPage &page2) const;
+    void compareTiled(const Documents &documents, const PagePair &pair,
+            const PdfPage &page1, const PdfPage &page2,
+            ComparedPair *compared);
+    QList<Patch> highlightedPatches(const PdfDocument &pdf,
+            const int document, const int pageNumber, const PdfPage &page,
+            const QPainterPath &highlighted, const QSize &size,
+            const qint64 budget);
+    const QList<QRect> tiledVisualRegions(const PagePair &pair,
+            const QSize &size1, const QSize &size2, const qint64 budget);
+    const QList<QRect> compareBand(const int left, const int right,
+            const QSize &pageSize, const QRect &band);
+    void prepareForOutput(ComparedPair *compared,
+            const QList<QRect> &areas1, const QList<QRect> &areas2);
+    void paintImages(QPainter *painter, const ComparedPair &compared,
             const QRect &leftRect, const QRect &rightRect,
             const SavePages savePages);
+    void paintImage(QPainter *painter, const QRect &pageRect,
+            const QImage &image, const QSize &size,
+            const QList<Patch> &patches);
     void compareAndSaveAsImages(const int start, const int end,
+            const QList<SavePages> &saves);
+    bool saveImage(const ComparedPair &compared, const QString &filename,
             const SavePages savePages);
+    QString imageFilename(const SavePages savePages) const;
+    void checkImageSaved(QFuture<bool> future, const QString &filename);
     void computeImageOffsets(const QSize &size, int *x, int *y,
             int *width, int *height);
+    QRect coarseRegion(const PdfPage &page);
+    QRectF textRect(const PdfPage &page);
     QRectF pointRectForMargins(const QSize &size);
-    QRect pixelRectForMargins(const QSize &size);
+    QRect pixelRectForMargins(const QSize &size, const int DPI);
 
     QBrush brush;
     QPen pen;
-    QVector<QVariant> diffStatuses;
+    QList<QPair<int, int> > pagePairs; // the page pairs to compare
+    QVector<QVariant> diffStatuses; // the pairs that differ, once written
     PdfDocument pdf1;
     PdfDocument pdf2;
+    const QByteArray data1; // the bytes of a streamed pdf1 (else empty)
+    const QByteArray data2;
+    QMutex documentsMutex;
+    QList<Documents> freeDocuments; // guarded by documentsMutex
+    RenderCache renderCache;
+    TextCache textCache;
+    int identicalPages; // page pairs skipped because of their fingerprints
+    QAtomicInt differenceFound; // set by check() workers to stop early
+    QAtomicInt loadFailed; // set by check() workers that can't read a page
+    QStringList errorMessages; // only added to by the writing thread
+    QAtomicInt dissimilarTexts; // texts marked changed without a diff
+    QList<int> deletedPages; // pages of pdf1 left unpaired
+    QList<int> insertedPages; // pages of pdf2 left unpaired
+    // The changed words or characters of each page when wholeDocument
+    // is set (pages without changes have no entry)
+    QHash<int, Ranges> documentChanges1;
+    QHash<int, Ranges> documentChanges2;
 
     // ====================================
     // CONFIGURABLE ARGUMENTS
@@ -132,6 +324,18 @@ private:
     const int rightMargin;
     const int bottomMargin;
 
+    const int minimumArea; // visual regions smaller than this (in pixels)
+                           // are taken to be antialiasing noise
+    const bool coarseToFine; // only render changed areas at the zoom DPI
+    const DiffAlgorithm algorithm; // used to diff the words or characters
+    const bool alignPages; // pair up pages by content rather than 1:1
+    const bool wholeDocument; // diff the text of all the pages in one go
+    const int outputDpi; // resolution of the output outside highlights
+    const int pngCompression; // 0-9, or -1 for Qt's default
+    const int maxMemory; // MB of page rasters to stay within (0 no limit)
+    const int minimumSimilarity; // percent; 0 to always diff the texts
+    const int jobs; // number of page pairs processed concurrently
+
     // ====================================
     // END CONFIGURABLE ARGUMENTS
     // ====================================
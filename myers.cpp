@@ -0,0 +1,158 @@
+/*
+    Copyright © 2011-13 Qtrac Ltd. All rights reserved.
+    This program or module is free software: you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 2 of
+    the License, or (at your option) any later version. This program is
+    distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+    for more details.
+*/
+
+#include "myers.hpp"
+
+
+QList<Match> MyersDiff::get_matching_blocks()
+{
+    matches.clear();
+    diff(0, a.count(), 0, b.count());
+
+    // The blocks come out in order, but may be adjacent
+    QList<Match> non_adjacent;
+    foreach (const Match &match, matches) {
+        if (!non_adjacent.isEmpty()) {
+            Match &last = non_adjacent.last();
+            if (last.i + last.size == match.i &&
+                last.j + last.size == match.j) {
+                last.size += match.size;
+                continue;
+            }
+        }
+        non_adjacent.append(match);
+    }
+    non_adjacent.append(Match(a.count(), b.count(), 0));
+    return non_adjacent;
+}
+
+
+void MyersDiff::diff(int a_low, int a_high, int b_low, int b_high)
+{
+    int prefix = 0;
+    while (a_low + prefix < a_high && b_low + prefix < b_high &&
+           a.at(a_low + prefix) == b.at(b_low + prefix))
+        ++prefix;
+    if (prefix) {
+        matches.append(Match(a_low, b_low, prefix));
+        a_low += prefix;
+        b_low += prefix;
+    }
+    int suffix = 0;
+    while (a_low < a_high - suffix && b_low < b_high - suffix &&
+           a.at(a_high - suffix - 1) == b.at(b_high - suffix - 1))
+        ++suffix;
+    a_high -= suffix;
+    b_high -= suffix;
+
+    int a_split;
+    int b_split;
+    if (a_low < a_high && b_low < b_high &&
+        bisect(a_low, a_high, b_low, b_high, &a_split, &b_split)) {
+        diff(a_low, a_split, b_low, b_split);
+        diff(a_split, a_high, b_split, b_high);
+    }
+    if (suffix)
+        matches.append(Match(a_high, b_high, suffix));
+}
+
+
+// Finds the middle snake of the edit graph by running the forward and
+// reverse searches until they overlap. Returns false if the two ranges
+// have nothing in common.
+bool MyersDiff::bisect(const int a_low, const int a_high, const int b_low,
+        const int b_high, int *a_split, int *b_split)
+{
+    const int LengthA = a_high - a_low;
+    const int LengthB = b_high - b_low;
+    const int MaxD = (LengthA + LengthB + 1) / 2;
+    const int Offset = MaxD;
+    const int Size = 2 * MaxD + 2;
+    QVector<int> forward(Size, -1);
+    QVector<int> reverse(Size, -1);
+    forward[Offset + 1] = 0;
+    reverse[Offset + 1] = 0;
+    const int Delta = LengthA - LengthB;
+    // If the delta is odd the forward search is the one to find the
+    // overlap, otherwise the reverse one is
+    const bool Front = Delta % 2 != 0;
+    int k1start = 0;
+    int k1end = 0;
+    int k2start = 0;
+    int k2end = 0;
+    for (int d = 0; d < MaxD; ++d) {
+        for (int k1 = -d + k1start; k1 <= d - k1end; k1 += 2) {
+            const int k1_offset = Offset + k1;
+            int x1;
+            if (k1 == -d || (k1 != d && forward.at(k1_offset - 1) <
+                                        forward.at(k1_offset + 1)))
+                x1 = forward.at(k1_offset + 1);
+            else
+                x1 = forward.at(k1_offset - 1) + 1;
+            int y1 = x1 - k1;
+            while (x1 < LengthA && y1 < LengthB &&
+                   a.at(a_low + x1) == b.at(b_low + y1)) {
+                ++x1;
+                ++y1;
+            }
+            forward[k1_offset] = x1;
+            if (x1 > LengthA)
+                k1end += 2; // Ran off the right of the graph
+            else if (y1 > LengthB)
+                k1start += 2; // Ran off the bottom of the graph
+            else if (Front) {
+                const int k2_offset = Offset + Delta - k1;
+                if (k2_offset >= 0 && k2_offset < Size &&
+                    reverse.at(k2_offset) != -1 &&
+                    x1 >= LengthA - reverse.at(k2_offset)) {
+                    *a_split = a_low + x1;
+                    *b_split = b_low + y1;
+                    return true;
+                }
+            }
+        }
+        for (int k2 = -d + k2start; k2 <= d - k2end; k2 += 2) {
+            const int k2_offset = Offset + k2;
+            int x2;
+            if (k2 == -d || (k2 != d && reverse.at(k2_offset - 1) <
+                                        reverse.at(k2_offset + 1)))
+                x2 = reverse.at(k2_offset + 1);
+            else
+                x2 = reverse.at(k2_offset - 1) + 1;
+            int y2 = x2 - k2;
+            while (x2 < LengthA && y2 < LengthB &&
+                   a.at(a_high - x2 - 1) == b.at(b_high - y2 - 1)) {
+                ++x2;
+                ++y2;
+            }
+            reverse[k2_offset] = x2;
+            if (x2 > LengthA)
+                k2end += 2;
+            else if (y2 > LengthB)
+                k2start += 2;
+            else if (!Front) {
+                const int k1_offset = Offset + Delta - k2;
+                if (k1_offset >= 0 && k1_offset < Size &&
+                    forward.at(k1_offset) != -1) {
+                    const int x1 = forward.at(k1_offset);
+                    const int y1 = Offset + x1 - k1_offset;
+                    if (x1 >= LengthA - x2) {
+                        *a_split = a_low + x1;
+                        *b_split = b_low + y1;
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+    return false;
+}
@@ -0,0 +1,43 @@
+#ifndef MYERS_HPP
+#define MYERS_HPP
+/*
+    Copyright © 2011-13 Qtrac Ltd. All rights reserved.
+    This program or module is free software: you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 2 of
+    the License, or (at your option) any later version. This program is
+    distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+    for more details.
+*/
+
+#include "sequence_matcher.hpp"
+#include <QList>
+#include <QVector>
+
+
+// Myers' O(ND) difference algorithm in linear space (divide and conquer
+// on the middle snake). It finds a longest common subsequence, so unlike
+// SequenceMatcher it never throws away popular elements, and its cost
+// grows with the number of differences rather than with the square of
+// the sequence length. The blocks are returned in the same form as
+// SequenceMatcher::get_matching_blocks().
+class MyersDiff
+{
+public:
+    MyersDiff(const Sequence &a_, const Sequence &b_) : a(a_), b(b_) {}
+
+    QList<Match> get_matching_blocks();
+
+private:
+    void diff(int a_low, int a_high, int b_low, int b_high);
+    bool bisect(const int a_low, const int a_high, const int b_low,
+                const int b_high, int *a_split, int *b_split);
+
+    const Sequence a;
+    const Sequence b;
+    QList<Match> matches;
+};
+
+#endif // MYERS_HPP
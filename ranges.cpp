@@ -0,0 +1,94 @@
+/*
+    Copyright © 2008-13 Qtrac Ltd. All rights reserved.
+    This program or module is free software: you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 2 of
+    the License, or (at your option) any later version. This program is
+    distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+    for more details.
+*/
+
+#include "ranges.hpp"
+
+
+void Ranges::add(const int start, const int end)
+{
+    Q_ASSERT(end >= start);
+    if (start == end)
+        return;
+    // The common case: the run comes after (or touches) the last one
+    if (runs_.isEmpty() || start > runs_.last().end) {
+        runs_.append(Run(start, end));
+        return;
+    }
+    if (start >= runs_.last().start) {
+        runs_.last().end = qMax(runs_.last().end, end);
+        return;
+    }
+    // Otherwise merge it with every run it overlaps or touches
+    QVector<Run> runs;
+    runs.reserve(runs_.count() + 1);
+    Run run(start, end);
+    bool added = false;
+    foreach (const Run &other, runs_) {
+        if (other.end < run.start)
+            runs.append(other);
+        else if (other.start > run.end) {
+            if (!added) {
+                runs.append(run);
+                added = true;
+            }
+            runs.append(other);
+        }
+        else {
+            run.start = qMin(run.start, other.start);
+            run.end = qMax(run.end, other.end);
+        }
+    }
+    if (!added)
+        runs.append(run);
+    runs_ = runs;
+}
+
+
+bool Ranges::contains(const int index) const
+{
+    int low = 0;
+    int high = runs_.count();
+    while (low < high) {
+        const int middle = (low + high) / 2;
+        if (runs_.at(middle).end <= index)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low < runs_.count() && runs_.at(low).start <= index;
+}
+
+
+int Ranges::count() const
+{
+    int total = 0;
+    foreach (const Run &run, runs_)
+        total += run.end - run.start;
+    return total;
+}
+
+
+// Returns the indexes in [0, length) that aren't in this set
+Ranges Ranges::inverted(const int length) const
+{
+    Ranges ranges;
+    int start = 0;
+    foreach (const Run &run, runs_) {
+        if (run.start >= length)
+            break;
+        ranges.add(start, run.start);
+        start = run.end;
+    }
+    if (start < length)
+        ranges.add(start, length);
+    return ranges;
+}
@@ -0,0 +1,47 @@
+#ifndef RANGES_HPP
+#define RANGES_HPP
+/*
+    Copyright © 2008-13 Qtrac Ltd. All rights reserved.
+    This program or module is free software: you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 2 of
+    the License, or (at your option) any later version. This program is
+    distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+    for more details.
+*/
+
+#include <QVector>
+
+
+// A set of indexes held as a sorted list of disjoint, non-touching
+// half-open runs [start, end). Adding indexes in ascending order (as the
+// diffs produce them) is O(1) each; everything else is O(runs).
+class Ranges
+{
+public:
+    struct Run
+    {
+        Run(const int start=0, const int end=0) : start(start), end(end) {}
+
+        int start;
+        int end;
+    };
+
+    Ranges() {}
+    Ranges(const int start, const int end) { add(start, end); }
+
+    void add(const int start, const int end);
+    void insert(const int index) { add(index, index + 1); }
+    bool contains(const int index) const;
+    bool isEmpty() const { return runs_.isEmpty(); }
+    int count() const;
+    const QVector<Run> &runs() const { return runs_; }
+    Ranges inverted(const int length) const;
+
+private:
+    QVector<Run> runs_;
+};
+
+#endif // RANGES_HPP
@@ -0,0 +1,74 @@
+/*
+    Copyright © 2008-13 Qtrac Ltd. All rights reserved.
+    This program or module is free software: you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 2 of
+    the License, or (at your option) any later version. This program is
+    distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+    for more details.
+*/
+
+#include "rendercache.hpp"
+#include <QHash>
+#include <QMutexLocker>
+
+
+uint qHash(const RenderKey &key)
+{
+    return ((key.document * 31 + key.page) * 31 + key.dpi) * 31 +
+           key.hints + qHash(key.rect.x()) + qHash(key.rect.y() << 8) +
+           qHash(key.rect.width() << 16) + qHash(key.rect.height() << 24);
+}
+
+
+RenderCache::RenderCache(const int maxKilobytes)
+    : hitCount(0), missCount(0)
+{
+    cache.setMaxCost(maxKilobytes);
+}
+
+
+void RenderCache::setMaxKilobytes(const int maxKilobytes)
+{
+    QMutexLocker locker(&mutex);
+    cache.setMaxCost(maxKilobytes);
+}
+
+
+QImage RenderCache::render(const PdfDocument &pdf, const int document,
+        const int pageNumber, const PdfPage &page, const int dpi,
+        const bool antialiased, const QRect &rect)
+{
+    const int Hints = antialiased ? (Poppler::Document::Antialiasing |
+                                     Poppler::Document::TextAntialiasing)
+                                  : 0;
+    const RenderKey key(document, pageNumber, dpi, Hints, rect);
+    {
+        QMutexLocker locker(&mutex);
+        if (QImage *image = cache.object(key)) {
+            hitCount.ref();
+            return *image;
+        }
+    }
+    missCount.ref();
+
+    // The document belongs to the calling worker, so it is safe to
+    // change its hints here
+    pdf->setRenderHint(Poppler::Document::Antialiasing, antialiased);
+    pdf->setRenderHint(Poppler::Document::TextAntialiasing, antialiased);
+    QImage image;
+    if (rect.isNull())
+        image = page->renderToImage(dpi, dpi);
+    else
+        image = page->renderToImage(dpi, dpi, rect.x(), rect.y(),
+                                    rect.width(), rect.height());
+
+    if (!image.isNull()) {
+        QMutexLocker locker(&mutex);
+        cache.insert(key, new QImage(image),
+                     qMax(1, image.byteCount() / 1024));
+    }
+    return image;
+}
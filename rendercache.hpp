@@ -0,0 +1,72 @@
+#ifndef RENDERCACHE_HPP
+#define RENDERCACHE_HPP
+/*
+    Copyright © 2008-13 Qtrac Ltd. All rights reserved.
+    This program or module is free software: you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 2 of
+    the License, or (at your option) any later version. This program is
+    distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+    for more details.
+*/
+
+#include "generic.hpp"
+#include <QAtomicInt>
+#include <QCache>
+#include <QImage>
+#include <QMutex>
+#include <QRect>
+
+
+struct RenderKey
+{
+    RenderKey(int document_, int page_, int dpi_, int hints_,
+              const QRect &rect_)
+        : document(document_), page(page_), dpi(dpi_), hints(hints_),
+          rect(rect_) {}
+
+    bool operator==(const RenderKey &other) const {
+        return document == other.document && page == other.page &&
+               dpi == other.dpi && hints == other.hints &&
+               rect == other.rect;
+    }
+
+    int document; // 1 or 2
+    int page;     // 0-based
+    int dpi;
+    int hints;
+    QRect rect;   // null for the whole page
+};
+
+uint qHash(const RenderKey &key);
+
+
+// Every page raster of a run is rendered through this cache, so that a
+// raster needed by several stages (or by both sides of --printSeparate)
+// is only produced once. It is shared by all the workers. The render
+// hints are set explicitly for every render, so rendering never depends
+// on (or changes) hints left behind on the document.
+class RenderCache
+{
+public:
+    explicit RenderCache(const int maxKilobytes=256 * 1024);
+
+    void setMaxKilobytes(const int maxKilobytes);
+
+    QImage render(const PdfDocument &pdf, const int document,
+            const int pageNumber, const PdfPage &page, const int dpi,
+            const bool antialiased, const QRect &rect=QRect());
+
+    int hits() const { return hitCount; }
+    int misses() const { return missCount; }
+
+private:
+    QMutex mutex;
+    QCache<RenderKey, QImage> cache; // guarded by mutex; cost is in KB
+    QAtomicInt hitCount;
+    QAtomicInt missCount;
+};
+
+#endif // RENDERCACHE_HPP
@@ -11,19 +11,23 @@
 */
 
 #include "sequence_matcher.hpp"
-#include <QSet>
 
 
 RangesPair computeRanges(SequenceMatcher *matcher)
+{
+    return computeRanges(matcher->get_matching_blocks());
+}
+
+
+RangesPair computeRanges(const QList<Match> &matches)
 {
     Ranges ranges1;
     Ranges ranges2;
-    QList<Match> matches = matcher->get_matching_blocks();
     foreach (const Match &match, matches) {
         if (match.size == 0)
             continue;
-        ranges1 |= unorderedRange(match.i + match.size, match.i);
-        ranges2 |= unorderedRange(match.j + match.size, match.j);
+        ranges1.add(match.i, match.i + match.size);
+        ranges2.add(match.j, match.j + match.size);
     }
     return qMakePair(ranges1, ranges2);
 }
@@ -32,9 +36,72 @@ RangesPair computeRanges(SequenceMatcher *matcher)
 RangesPair invertRanges(const Ranges &ranges1, int length1,
                         const Ranges &ranges2, int length2)
 {
-    const Ranges newRanges1 = unorderedRange(length1) - ranges1;
-    const Ranges newRanges2 = unorderedRange(length2) - ranges2;
-    return qMakePair(newRanges1, newRanges2);
+    return qMakePair(ranges1.inverted(length1), ranges2.inverted(length2));
+}
+
+
+const Sequence TokenTable::intern(const QStringList &tokens)
+{
+    Sequence sequence;
+    sequence.reserve(tokens.count());
+    foreach (const QString &token, tokens) {
+        QHash<QString, Element>::const_iterator i = ids.constFind(token);
+        if (i == ids.constEnd())
+            i = ids.insert(token, ids.count());
+        sequence.append(i.value());
+    }
+    return sequence;
+}
+
+
+double realQuickRatio(const Sequence &a, const Sequence &b)
+{
+    const int total = a.count() + b.count();
+    if (total == 0)
+        return 1.0;
+    return 2.0 * qMin(a.count(), b.count()) / total;
+}
+
+
+// The IDs are dense, so the multiset intersection is counted in an
+// array rather than a hash
+double quickRatio(const Sequence &a, const Sequence &b,
+                  const int tokenCount)
+{
+    const int total = a.count() + b.count();
+    if (total == 0)
+        return 1.0;
+    QVector<int> available(tokenCount, 0);
+    foreach (const Element element, b)
+        ++available[element];
+    int matches = 0;
+    foreach (const Element element, a) {
+        if (available.at(element) > 0) {
+            --available[element];
+            ++matches;
+        }
+    }
+    return 2.0 * matches / total;
+}
+
+
+// Looks each item up through a view of its text, so that only the
+// distinct tokens are copied (into the table)
+const Sequence TokenTable::intern(const TextItems &items)
+{
+    Sequence sequence;
+    sequence.reserve(items.count());
+    for (int index = 0; index < items.count(); ++index) {
+        const QStringRef text = items.text(index);
+        const QString token = QString::fromRawData(text.unicode(),
+                                                   text.size());
+        QHash<QString, Element>::const_iterator i = ids.constFind(token);
+        if (i == ids.constEnd())
+            i = ids.insert(QString(text.unicode(), text.size()),
+                           ids.count());
+        sequence.append(i.value());
+    }
+    return sequence;
 }
 
 
@@ -79,32 +146,34 @@ void SequenceMatcher::set_sequence2(const Sequence &sequence)
     b = sequence;
     matching_blocks.clear();
     chain_b();
+    j2len.fill(0, b.count() + 1);
+    newj2len.fill(0, b.count() + 1);
 }
 
 
 void SequenceMatcher::chain_b()
 {
     const int N = b.count();
+    Element largest = 0;
+    foreach (const Element element, b)
+        largest = qMax(largest, element);
     b2j.clear();
-    QSet<Element> popular;
+    b2j.resize(N ? largest + 1 : 0);
+    QVector<bool> popular(b2j.count(), false);
 
     for (int i = 0; i < N; ++i) {
-        const Element &element = b.at(i);
-        if (b2j.contains(element)) {
-            QList<int> &indexes = b2j[element];
-            if (N >= 200 && indexes.count() * 100 > N) {
-                popular.insert(element);
-                indexes.clear();
-            }
-            else
-                indexes.append(i);
+        QVector<int> &indexes = b2j[b.at(i)];
+        if (!indexes.isEmpty() && N >= 200 && indexes.count() * 100 > N) {
+            popular[b.at(i)] = true;
+            indexes.clear();
         }
         else
-            b2j[element].append(i);
+            indexes.append(i);
     }
 
-    foreach (const Element &element, popular)
-        b2j.remove(element);
+    for (int element = 0; element < popular.count(); ++element)
+        if (popular.at(element))
+            b2j[element].clear();
 }
 
 
@@ -170,24 +239,37 @@ Match SequenceMatcher::find_longest_match(int a_low, int a_high,
     int best_i = a_low;
     int best_j = b_low;
     int best_size = 0;
-    QHash<int, int> j2len;
+    // Only the entries that were set are cleared again, so each row
+    // costs what it matches rather than the length of b
+    QVector<int> touched;
+    QVector<int> newTouched;
+    static const QVector<int> None;
     for (int i = a_low; i < a_high; ++i) {
-        QHash<int, int> newj2len;
-        foreach (int j, b2j.value(a[i])) {
+        const Element element = a.at(i);
+        const QVector<int> &indexes = element < static_cast<Element>(
+                b2j.count()) ? b2j.at(element) : None;
+        foreach (const int j, indexes) {
             if (j < b_low)
                 continue;
             if (j >= b_high)
                 break;
-            const int k = j2len.value(j - 1, 0) + 1;
-            newj2len[j] = k;
+            const int k = j2len.at(j) + 1; // j2len[j] is for j - 1
+            newj2len[j + 1] = k;
+            newTouched.append(j + 1);
             if (k > best_size) {
                 best_i = i - k + 1;
                 best_j = j - k + 1;
                 best_size = k;
             }
         }
-        j2len = newj2len;
+        foreach (const int j, touched)
+            j2len[j] = 0;
+        qSwap(j2len, newj2len);
+        qSwap(touched, newTouched);
+        newTouched.clear();
     }
+    foreach (const int j, touched)
+        j2len[j] = 0;
 
     while (best_i > a_low && best_j > b_low &&
            a[best_i - 1] == b[best_j - 1]) {
@@ -13,20 +13,50 @@
 */
 
 #include "generic.hpp"
+#include "textitem.hpp"
 #include <QHash>
 #include <QList>
 #include <QString>
 #include <QStringList>
+#include <QVector>
 
-typedef QStringList Sequence;
-typedef QString Element;
+// The matchers work on tokens interned into dense integer IDs, so they
+// compare and index ints rather than hashing strings
+typedef QVector<quint32> Sequence;
+typedef quint32 Element;
 
 class SequenceMatcher;
 
+struct Match;
+
 RangesPair computeRanges(SequenceMatcher *matcher);
+RangesPair computeRanges(const QList<Match> &matches);
 RangesPair invertRanges(const Ranges &ranges1, int length1,
                         const Ranges &ranges2, int length2);
 
+// Upper bounds on the similarity ratio (2 * matched / total length) of
+// two sequences, like difflib's real_quick_ratio() and quick_ratio():
+// the first only looks at the lengths, the second at the tokens the two
+// have in common regardless of their order. tokenCount is the number of
+// distinct IDs in the table the sequences were interned with.
+double realQuickRatio(const Sequence &a, const Sequence &b);
+double quickRatio(const Sequence &a, const Sequence &b,
+                  const int tokenCount);
+
+// Gives each distinct string its own ID. Intern both sequences of a
+// pair with the same table.
+class TokenTable
+{
+public:
+    const Sequence intern(const QStringList &tokens);
+    const Sequence intern(const TextItems &items);
+    int count() const { return ids.count(); }
+
+private:
+    QHash<QString, Element> ids;
+};
+
+
 struct Match
 {
     Match(int i_=0, int j_=0, int size_=0) : i(i_), j(j_), size(size_) {}
@@ -57,8 +87,13 @@ private:
 
     Sequence a;
     Sequence b;
-    QHash<Element, QList<int> > b2j;
+    // Indexed by element; empty for elements not in b (or popular ones)
+    QVector<QVector<int> > b2j;
     QList<Match> matching_blocks;
+    // find_longest_match()'s rows of match lengths, indexed by j + 1;
+    // they're kept zeroed between calls so they're only allocated once
+    QVector<int> j2len;
+    QVector<int> newj2len;
 };
 
 #endif // SEQUENCE_MATCHER_HPP
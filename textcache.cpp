@@ -0,0 +1,108 @@
+/*
+    Copyright © 2008-13 Qtrac Ltd. All rights reserved.
+    This program or module is free software: you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 2 of
+    the License, or (at your option) any later version. This program is
+    distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+    for more details.
+*/
+
+#include "textcache.hpp"
+#include <QMutexLocker>
+#include <QVector>
+
+
+static const TextBoxList inReadingOrder(const TextBoxList &boxes,
+                                        const int Width)
+{
+    QVector<QRectF> rects;
+    rects.reserve(boxes.count());
+    foreach (const PdfTextBox &box, boxes)
+        rects << box->boundingBox();
+    TextBoxList ordered;
+    foreach (const int index, readingOrder(rects, Width))
+        ordered << boxes.at(index);
+    return ordered;
+}
+
+
+TextCache::TextCache(const int maxBoxes)
+    : hitCount(0), missCount(0), readingOrder(false)
+{
+    cache.setMaxCost(maxBoxes);
+}
+
+
+const TextBoxList TextCache::boxes(const int document,
+        const int pageNumber, const PdfPage &page, const QRectF &rect)
+{
+    return boxesFor(qMakePair(document, pageNumber), page, rect);
+}
+
+
+const TextItems TextCache::words(const int document,
+        const int pageNumber, const PdfPage &page, const QRectF &rect)
+{
+    const Key key(document, pageNumber);
+    {
+        QMutexLocker locker(&mutex);
+        PageText *text = cache.object(key);
+        if (text && text->hasWords) {
+            hitCount.ref();
+            return text->words;
+        }
+    }
+    const TextItems items = getWords(boxesFor(key, page, rect));
+    QMutexLocker locker(&mutex);
+    if (PageText *text = cache.object(key)) {
+        text->words = items;
+        text->hasWords = true;
+    }
+    return items;
+}
+
+
+const TextItems TextCache::characters(const int document,
+        const int pageNumber, const PdfPage &page, const QRectF &rect)
+{
+    const Key key(document, pageNumber);
+    {
+        QMutexLocker locker(&mutex);
+        PageText *text = cache.object(key);
+        if (text && text->hasCharacters) {
+            hitCount.ref();
+            return text->characters;
+        }
+    }
+    const TextItems items = getCharacters(boxesFor(key, page, rect));
+    QMutexLocker locker(&mutex);
+    if (PageText *text = cache.object(key)) {
+        text->characters = items;
+        text->hasCharacters = true;
+    }
+    return items;
+}
+
+
+const TextBoxList TextCache::boxesFor(const Key &key, const PdfPage &page,
+        const QRectF &rect)
+{
+    {
+        QMutexLocker locker(&mutex);
+        if (PageText *text = cache.object(key)) {
+            hitCount.ref();
+            return text->boxes;
+        }
+    }
+    missCount.ref();
+    TextBoxList boxes = getTextBoxes(page, rect);
+    if (readingOrder)
+        boxes = inReadingOrder(boxes, page->pageSizeF().width());
+    QMutexLocker locker(&mutex);
+    if (!cache.contains(key))
+        cache.insert(key, new PageText(boxes), qMax(1, boxes.count()));
+    return boxes;
+}
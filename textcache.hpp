@@ -0,0 +1,73 @@
+#ifndef TEXTCACHE_HPP
+#define TEXTCACHE_HPP
+/*
+    Copyright © 2008-13 Qtrac Ltd. All rights reserved.
+    This program or module is free software: you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 2 of
+    the License, or (at your option) any later version. This program is
+    distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+    for more details.
+*/
+
+#include "generic.hpp"
+#include "textitem.hpp"
+#include <QAtomicInt>
+#include <QCache>
+#include <QMutex>
+#include <QPair>
+#include <QRectF>
+
+
+// Holds the text extracted from each page so that page->textList() and
+// the getWords()/getCharacters() splitting are only done once per page,
+// no matter how many stages (or workers) need the text. The margins
+// rect must be the same for every lookup of a given page. With reading
+// order set, each page's boxes are put into reading order (see
+// readingOrder()) as they're extracted, so the words and characters
+// follow it too.
+class TextCache
+{
+public:
+    explicit TextCache(const int maxBoxes=256 * 1024);
+
+    void setReadingOrder(const bool on) { readingOrder = on; }
+
+    const TextBoxList boxes(const int document, const int pageNumber,
+            const PdfPage &page, const QRectF &rect=QRectF());
+    const TextItems words(const int document, const int pageNumber,
+            const PdfPage &page, const QRectF &rect=QRectF());
+    const TextItems characters(const int document, const int pageNumber,
+            const PdfPage &page, const QRectF &rect=QRectF());
+
+    int hits() const { return hitCount; }
+    int misses() const { return missCount; }
+
+private:
+    typedef QPair<int, int> Key; // (document, page)
+
+    struct PageText
+    {
+        PageText(const TextBoxList &boxes_)
+            : boxes(boxes_), hasWords(false), hasCharacters(false) {}
+
+        TextBoxList boxes;
+        TextItems words;
+        TextItems characters;
+        bool hasWords;
+        bool hasCharacters;
+    };
+
+    const TextBoxList boxesFor(const Key &key, const PdfPage &page,
+            const QRectF &rect);
+
+    QMutex mutex;
+    QCache<Key, PageText> cache; // guarded by mutex; cost is in boxes
+    QAtomicInt hitCount;
+    QAtomicInt missCount;
+    bool readingOrder; // set before any lookups
+};
+
+#endif // TEXTCACHE_HPP
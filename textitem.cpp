@@ -13,27 +13,56 @@
 #include "textitem.hpp"
 
 #include <QDir>
+#include <QHash>
+#include <QtAlgorithms>
+#include <QtCore/qmath.h>
 #include <QFile>
 #include <QTextStream>
 
 
-QStringList TextItems::texts() const
+void TextItems::append(const QString &text, const QRectF &rect)
 {
-    QStringList list;
-    foreach (const TextItem &item, items)
-        list << item.text;
-    return list;
+    buffer.append(text);
+    offsets << buffer.size();
+    rects_ << rect;
+}
+
+
+void TextItems::append(const QChar &character, const QRectF &rect)
+{
+    buffer.append(character);
+    offsets << buffer.size();
+    rects_ << rect;
+}
+
+
+void TextItems::append(const TextItems &other)
+{
+    const int offset = buffer.size();
+    buffer.append(other.buffer);
+    for (int i = 1; i < other.offsets.count(); ++i)
+        offsets << offset + other.offsets.at(i);
+    rects_ << other.rects_;
+}
+
+
+void TextItems::reserve(const int count, const int characters)
+{
+    buffer.reserve(characters);
+    offsets.reserve(count + 1);
+    rects_.reserve(count);
 }
 
 
-QList<QRectF> TextItems::rects() const
+QStringList TextItems::texts() const
 {
-    QList<QRectF> list;
-    foreach (const TextItem &item, items)
-        list << item.rect;
+    QStringList list;
+    for (int i = 0; i < count(); ++i)
+        list << text(i).toString();
     return list;
 }
 
+
 struct Key
 {
     Key(const int a, const int b, const int c) : a(a), b(b), c(c) {}
@@ -48,91 +77,169 @@ struct Key
 };
 
 
-void TextItems::columnZoneYxOrder(const int Width, const int ToleranceR,
-        const int ToleranceY, const int Columns)
-{
-    // Phase #1: Sort all the texts into (column, y, x) order
-    columnYxOrder(Width, ToleranceY, Columns);
-    // Phase #2: Sort all the texts into (column, zone, y, x) order
-    QList<QPainterPath> zones = generateZones(Width, ToleranceR,
-                                              ToleranceY, Columns);
-    QMap<Key, TextItem> itemForZoneYx;
-    foreach (const TextItem &item, items) {
-        const QRectF rect = item.rect.adjusted(-ToleranceR, -ToleranceR,
-                                               ToleranceR, ToleranceR);
-        const int y = normalizedY(static_cast<int>(item.rect.y()),
-                                  ToleranceY);
-        for (int i = 0; i < zones.count(); ++i) {
-            if (zones.at(i).intersects(rect)) {
-                itemForZoneYx.insert(Key(i, y, item.rect.x()), item);
-                break;
-            }
+// Finds the columns from a projection profile of the rects onto the x
+// axis: a strip at least MinimumGutter points wide that no rect covers
+// is a gutter. Rects wider than half the page (e.g., headings across the
+// columns) are left out of the profile. Returns the x of the middle of
+// each gutter, from left to right.
+const QList<qreal> columnGutters(const QVector<QRectF> &rects,
+                                 const int Width)
+{
+    const int MinimumGutter = 10;
+    QList<qreal> gutters;
+    if (Width <= 0)
+        return gutters;
+    QVector<int> profile(Width + 1, 0); // coverage changes at each x
+    foreach (const QRectF &rect, rects) {
+        if (rect.width() > Width / 2)
+            continue;
+        const int left = qBound(0, qFloor(rect.left()), Width);
+        const int right = qBound(0, qCeil(rect.right()), Width);
+        if (left < right) {
+            ++profile[left];
+            --profile[right];
         }
     }
-    items = itemForZoneYx.values();
+    int coverage = 0;
+    int lastCovered = -1;
+    for (int x = 0; x < Width; ++x) {
+        coverage += profile.at(x);
+        if (coverage == 0)
+            continue;
+        if (lastCovered != -1 && x - lastCovered - 1 >= MinimumGutter)
+            gutters << (lastCovered + 1 + x) / 2.0;
+        lastCovered = x;
+    }
+    return gutters;
 }
 
 
-void TextItems::columnYxOrder(const int Width, const int ToleranceY,
-                              const int Columns)
+// Returns -1 for a rect that straddles a gutter
+static int columnOf(const QRectF &rect, const QList<qreal> &gutters)
 {
-    // Phase #1: Sort all the texts into (column, y, x) order
-    const int Span = Width / Columns;
-    QMap<Key, TextItem> itemForColumnYx;
-    foreach (const TextItem &item, items) {
-        const QRect &rect = item.toRect();
-        const int Column = ((Columns == 1) ? 0
-            : (rect.width() > Span) ? Columns : rect.right() / Span);
-        const int y = normalizedY(static_cast<int>(rect.y()), ToleranceY);
-        itemForColumnYx.insert(Key(Column, y, rect.x()), item);
+    int column = 0;
+    foreach (const qreal gutter, gutters) {
+        if (rect.right() <= gutter)
+            return column;
+        if (rect.left() < gutter)
+            return -1;
+        ++column;
     }
-    items = itemForColumnYx.values();
-}
-
-
-const QList<QPainterPath> TextItems::generateZones(const int Width,
-        const int ToleranceR, const int ToleranceY,
-        const int Columns) const
-{ // Assumes that items are already in column, y, x order!
-    // Phase #1: Generate the zones
-    QList<QPainterPath> zones;
-    foreach (const TextItem &item, items) {
-        if (zones.isEmpty()) { // First word becomes first zone
-            QPainterPath zone;
-            zone.addRect(item.rect);
-            zones << zone;
-        } else { // Add to an existing zone within tolerance or a new one
-            const QRectF tolerantRect = item.rect.adjusted(-ToleranceR,
-                    -ToleranceR, ToleranceR, ToleranceR);
-            bool found = false;
-            for (int i = 0; i < zones.count(); ++i) {
-                QPainterPath zone = zones.at(i);
-                if (zone.intersects(tolerantRect)) {
-                    zone.addRect(item.rect);
-                    zones[i] = zone;
-                    found = true;
-                    break;
+    return column;
+}
+
+
+// Unlike QRectF::intersects() this counts touching and zero width (e.g.,
+// space) rects
+static bool touches(const QRectF &a, const QRectF &b)
+{
+    return a.left() <= b.right() && b.left() <= a.right() &&
+           a.top() <= b.bottom() && b.top() <= a.bottom();
+}
+
+
+static int zoneRoot(QVector<int> *parents, int index)
+{
+    while (parents->at(index) != index) {
+        (*parents)[index] = parents->at(parents->at(index));
+        index = parents->at(index);
+    }
+    return index;
+}
+
+
+// Groups the rects into zones (roughly, paragraphs): rects within
+// ToleranceR points of one another are in the same zone. The rects are
+// bucketed into a uniform grid as they're added, so each one is only
+// tested against those in the cells it reaches. Returns each rect's zone
+// as the index of one of the zone's rects.
+const QVector<int> zonesOf(const QVector<QRectF> &rects,
+                           const int ToleranceR)
+{
+    const qreal CellSize = qMax(32, 4 * ToleranceR);
+    QVector<int> parents(rects.count());
+    QHash<QPair<int, int>, QVector<int> > grid; // cell to rects
+    for (int index = 0; index < rects.count(); ++index) {
+        parents[index] = index;
+        const QRectF &rect = rects.at(index);
+        const QRectF tolerantRect = rect.adjusted(-ToleranceR, -ToleranceR,
+                                                  ToleranceR, ToleranceR);
+        for (int x = qFloor(tolerantRect.left() / CellSize);
+             x <= qFloor(tolerantRect.right() / CellSize); ++x) {
+            for (int y = qFloor(tolerantRect.top() / CellSize);
+                 y <= qFloor(tolerantRect.bottom() / CellSize); ++y) {
+                foreach (const int other, grid.value(qMakePair(x, y))) {
+                    if (touches(tolerantRect, rects.at(other)))
+                        parents[zoneRoot(&parents, other)] =
+                                zoneRoot(&parents, index);
                 }
             }
-            if (!found) {
-                QPainterPath zone;
-                zone.addRect(item.rect);
-                zones << zone;
-            }
         }
+        for (int x = qFloor(rect.left() / CellSize);
+             x <= qFloor(rect.right() / CellSize); ++x)
+            for (int y = qFloor(rect.top() / CellSize);
+                 y <= qFloor(rect.bottom() / CellSize); ++y)
+                grid[qMakePair(x, y)] << index;
     }
+    QVector<int> zones(rects.count());
+    for (int index = 0; index < rects.count(); ++index)
+        zones[index] = zoneRoot(&parents, index);
+    return zones;
+}
 
-    // Phase #2: Order the zones by (column, y, x)
-    const int Span = Width / Columns;
-    QMultiMap<Key, QPainterPath> zonesForColumn;
-    foreach (const QPainterPath &zone, zones) {
-        const QRect &rect = zone.boundingRect().toRect();
-        const int Column = ((Columns == 1) ? 0
-            : (rect.width() > Span) ? Columns : rect.right() / Span);
-        const int y = normalizedY(static_cast<int>(rect.y()), ToleranceY);
-        zonesForColumn.insertMulti(Key(Column, y, rect.x()), zone);
+
+// Returns the indexes of the rects in reading order. Each zone that
+// spans the columns (e.g., a heading or a full width figure caption)
+// starts a new section of the page, so the page reads as the columns
+// above the first spanning zone, that zone, the columns below it, and so
+// on. The zones are ordered by (section, column, y, x), and the rects
+// within each zone by (y, x).
+const QList<int> readingOrder(const QVector<QRectF> &rects,
+        const int Width, const int ToleranceR, const int ToleranceY)
+{
+    const QList<qreal> gutters = columnGutters(rects, Width);
+    const QVector<int> zones = zonesOf(rects, ToleranceR);
+    QHash<int, QRectF> zoneRects;
+    for (int index = 0; index < rects.count(); ++index)
+        zoneRects[zones.at(index)] |= rects.at(index);
+    QList<qreal> spanningYs; // the middle of each spanning zone
+    foreach (const QRectF &rect, zoneRects)
+        if (columnOf(rect, gutters) == -1)
+            spanningYs << rect.center().y();
+    qSort(spanningYs);
+    // Sections 0, 2, 4, ... hold columns; 1, 3, 5, ... a spanning zone
+    const int Columns = gutters.count() + 1;
+    QList<QPair<Key, int> > zoneOrder;
+    QHashIterator<int, QRectF> i(zoneRects);
+    while (i.hasNext()) {
+        i.next();
+        const QRectF &rect = i.value();
+        int column = columnOf(rect, gutters);
+        const int above = qLowerBound(spanningYs.constBegin(),
+                spanningYs.constEnd(), rect.center().y()) -
+                spanningYs.constBegin();
+        const int section = column == -1 ? 2 * above + 1 : 2 * above;
+        column = qMax(0, column);
+        zoneOrder << qMakePair(Key(section * Columns + column,
+                normalizedY(static_cast<int>(rect.y()), ToleranceY),
+                static_cast<int>(rect.x())), i.key());
+    }
+    qSort(zoneOrder);
+    QHash<int, int> zoneRanks;
+    for (int rank = 0; rank < zoneOrder.count(); ++rank)
+        zoneRanks.insert(zoneOrder.at(rank).second, rank);
+    QList<QPair<Key, int> > order;
+    for (int index = 0; index < rects.count(); ++index) {
+        const QRectF &rect = rects.at(index);
+        order << qMakePair(Key(zoneRanks.value(zones.at(index)),
+                normalizedY(static_cast<int>(rect.y()), ToleranceY),
+                static_cast<int>(rect.x())), index);
     }
-    return zonesForColumn.values();
+    qSort(order);
+    QList<int> indexes;
+    for (int index = 0; index < order.count(); ++index)
+        indexes << order.at(index).second;
+    return indexes;
 }
 
 
@@ -154,15 +261,15 @@ void TextItems::debug(const int page, const int ToleranceY,
     out.setCodec("UTF-8");
     out << "Page #" << page << ": "
         << (ComparingWords ? "Words" : "Characters") << " mode\n";
-    for (int i = 0; i < items.count(); ++i) {
-        const TextItem &item = items.at(i);
-        const QRect rect = item.toRect();
-        out << item.text;
-        if (!ComparingWords)
-            out << QString(" %1").arg(item.text.at(0).unicode(), 4, 16,
+    for (int i = 0; i < count(); ++i) {
+        const QStringRef itemText = text(i);
+        const QRect rect = rects_.at(i).toRect();
+        out << itemText.toString();
+        if (!ComparingWords && !itemText.isEmpty())
+            out << QString(" %1").arg(itemText.at(0).unicode(), 4, 16,
                                       QChar('0'));
         if (Yx) {
-            const int y = normalizedY(static_cast<int>(item.rect.y()),
+            const int y = normalizedY(static_cast<int>(rects_.at(i).y()),
                                       ToleranceY);
             out << QString(" (%1, %2)").arg(y).arg(rect.x());
         }
@@ -184,13 +291,14 @@ inline int normalizedY(const int y, const int ToleranceY)
 const TextItems getWords(const TextBoxList &list)
 {
     TextItems items;
+    items.reserve(list.count(), list.count() * 8);
     foreach (const PdfTextBox &box, list) {
         QString word = box->text().trimmed();
         for (int i = 0; i < word.length(); ++i)
             word[i] = canonicalizedCharacter(word[i]);
         // DON'T DO: if (!word.isEmpty()) words << word;
         // since it can mess up highlighting.
-        items.append(TextItem(word, box->boundingBox()));
+        items.append(word, box->boundingBox());
     }
     return items;
 }
@@ -199,16 +307,21 @@ const TextItems getWords(const TextBoxList &list)
 const TextItems getCharacters(const TextBoxList &list)
 {
     TextItems items;
-    foreach (const PdfTextBox &box, list) {
-        const QString word = box->text();
-        int limit = word.count() - 1;
-        for (int i = limit; i >= 0; --i)
-            if (!word[i].isSpace())
-                break;
-        for (int i = 0; i <= limit; ++i) {
-            items.append(TextItem(QString(canonicalizedCharacter(word[i])),
-                                  box->charBoundingBox(i)));
-        }
-    }
+    foreach (const PdfTextBox &box, list)
+        appendCharacters(box, &items);
     return items;
 }
+
+
+void appendCharacters(const PdfTextBox &box, TextItems *items)
+{
+    const QString word = box->text();
+    int limit = word.count() - 1;
+    for (int i = limit; i >= 0; --i)
+        if (!word[i].isSpace())
+            break;
+    for (int i = 0; i <= limit; ++i) {
+        items->append(canonicalizedCharacter(word[i]),
+                      box->charBoundingBox(i));
+    }
+}
@@ -18,6 +18,7 @@
 #include <QPainterPath>
 #include <QRectF>
 #include <QString>
+#include <QVector>
 
 
 struct TextItem
@@ -32,33 +33,53 @@ struct TextItem
 };
 
 
+// The words or characters of a page held as parallel arrays: every
+// item's text is a slice of one shared buffer (item i's runs from
+// offsets[i] to offsets[i + 1]) and its rect is rects()[i]. So a page of
+// thousands of words is three allocations rather than one per word, and
+// copies (e.g., out of the TextCache) just share the arrays.
 class TextItems
 {
 public:
-    TextItem at(const int index) const { return items.at(index); }
-    void append(const TextItem &item) { items << item; }
-    int count() const { return items.count(); }
+    TextItems() { offsets << 0; }
+
+    TextItem at(const int index) const
+        { return TextItem(text(index).toString(), rects_.at(index)); }
+    // A view into the buffer, valid until the items are changed
+    QStringRef text(const int index) const
+        { return QStringRef(&buffer, offsets.at(index),
+                            offsets.at(index + 1) - offsets.at(index)); }
+    const QRectF &rect(const int index) const { return rects_.at(index); }
+    const QVector<QRectF> &rects() const { return rects_; }
+    void append(const TextItem &item) { append(item.text, item.rect); }
+    void append(const QString &text, const QRectF &rect);
+    void append(const QChar &character, const QRectF &rect);
+    void append(const TextItems &other);
+    int count() const { return rects_.count(); }
+    void reserve(const int count, const int characters);
     QStringList texts() const;
-    QList<QRectF> rects() const;
-    void columnZoneYxOrder(const int Width, const int ToleranceR,
-            const int ToleranceY, const int Columns);
-    void columnYxOrder(const int Width, const int ToleranceY,
-                       const int Columns);
-    const QList<QPainterPath> generateZones(const int Width,
-            const int ToleranceR, const int ToleranceY,
-            const int Columns) const;
 
     void debug(const int page, const int ToleranceY,
                const bool ComparingWords=true, const bool Yx=false);
 
 private:
-    QList<TextItem> items;
+    QString buffer;
+    QVector<int> offsets; // count() + 1 of them
+    QVector<QRectF> rects_;
 };
 
 
 inline int normalizedY(const int y, const int ToleranceY);
 
+const QList<qreal> columnGutters(const QVector<QRectF> &rects,
+                                 const int Width);
+const QVector<int> zonesOf(const QVector<QRectF> &rects,
+                           const int ToleranceR);
+const QList<int> readingOrder(const QVector<QRectF> &rects,
+        const int Width, const int ToleranceR=4, const int ToleranceY=4);
+
 const TextItems getWords(const TextBoxList &list);
 const TextItems getCharacters(const TextBoxList &list);
+void appendCharacters(const PdfTextBox &box, TextItems *items);
 
 #endif // TEXTITEM_HPP
@@ -0,0 +1,253 @@
+/*
+    Copyright © 2008-13 Qtrac Ltd. All rights reserved.
+    This program or module is free software: you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 2 of
+    the License, or (at your option) any later version. This program is
+    distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+    for more details.
+*/
+
+#include "tilecompare.hpp"
+#include <QHash>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || \
+    (defined(__GNUC__) && (__GNUC__ > 4 || \
+                           (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define TILECOMPARE_X86
+#include <immintrin.h>
+#endif
+
+
+// Returns the index of the first pixel in [begin, end) where the two
+// scanlines differ in the bits set in mask, or end if there is none
+typedef int (*FindMismatch)(const quint32 *line1, const quint32 *line2,
+                            int begin, const int end, const quint32 mask);
+
+
+static int findMismatchScalar(const quint32 *line1, const quint32 *line2,
+                              int begin, const int end, const quint32 mask)
+{
+    for (; begin < end; ++begin)
+        if ((line1[begin] ^ line2[begin]) & mask)
+            return begin;
+    return end;
+}
+
+
+#ifdef TILECOMPARE_X86
+__attribute__((target("sse2")))
+static int findMismatchSse2(const quint32 *line1, const quint32 *line2,
+                            int begin, const int end, const quint32 mask)
+{
+    const __m128i Mask = _mm_set1_epi32(static_cast<int>(mask));
+    const __m128i Zero = _mm_setzero_si128();
+    for (; begin + 4 <= end; begin += 4) {
+        const __m128i a = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(line1 + begin));
+        const __m128i b = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(line2 + begin));
+        const __m128i x = _mm_and_si128(_mm_xor_si128(a, b), Mask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, Zero)) != 0xFFFF)
+            break;
+    }
+    return findMismatchScalar(line1, line2, begin, end, mask);
+}
+
+
+__attribute__((target("avx2")))
+static int findMismatchAvx2(const quint32 *line1, const quint32 *line2,
+                            int begin, const int end, const quint32 mask)
+{
+    const __m256i Mask = _mm256_set1_epi32(static_cast<int>(mask));
+    for (; begin + 8 <= end; begin += 8) {
+        const __m256i a = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(line1 + begin));
+        const __m256i b = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(line2 + begin));
+        if (!_mm256_testz_si256(_mm256_xor_si256(a, b), Mask))
+            break;
+    }
+    return findMismatchScalar(line1, line2, begin, end, mask);
+}
+#endif
+
+
+static FindMismatch bestFindMismatch()
+{
+#ifdef TILECOMPARE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return findMismatchAvx2;
+    if (__builtin_cpu_supports("sse2"))
+        return findMismatchSse2;
+#endif
+    return findMismatchScalar;
+}
+
+
+static FindMismatch findMismatch = bestFindMismatch();
+
+
+bool setTileKernel(const TileKernel kernel)
+{
+    switch (kernel) {
+        case BestTileKernel: findMismatch = bestFindMismatch(); return true;
+        case ScalarTileKernel: findMismatch = findMismatchScalar; return true;
+#ifdef TILECOMPARE_X86
+        case Sse2TileKernel:
+            __builtin_cpu_init();
+            if (!__builtin_cpu_supports("sse2"))
+                return false;
+            findMismatch = findMismatchSse2;
+            return true;
+        case Avx2TileKernel:
+            __builtin_cpu_init();
+            if (!__builtin_cpu_supports("avx2"))
+                return false;
+            findMismatch = findMismatchAvx2;
+            return true;
+#endif
+        default: return false;
+    }
+}
+
+
+static void markDirtyTiles(const quint32 *bits1, const int pixelsPerLine1,
+        const quint32 *bits2, const int pixelsPerLine2, const int width,
+        const int height, const int squareSize, const quint32 mask,
+        DirtyTiles *tiles)
+{
+    const int Columns = (width + squareSize - 1) / squareSize;
+    const int Rows = (height + squareSize - 1) / squareSize;
+    tiles->resize(Columns, Rows);
+    for (int y = 0; y < height; ++y) {
+        const quint32 *line1 = bits1 + y * pixelsPerLine1;
+        const quint32 *line2 = bits2 + y * pixelsPerLine2;
+        uchar *flags = tiles->row(y / squareSize);
+        int x = 0;
+        while (x < width) {
+            int column = x / squareSize;
+            if (flags[column]) { // Already dirty: nothing left to find
+                x = (column + 1) * squareSize;
+                continue;
+            }
+            // Scan the whole run of clean tiles in one go
+            int last = column;
+            while (last < Columns && !flags[last])
+                ++last;
+            const int end = qMin(last * squareSize, width);
+            const int i = findMismatch(line1, line2, x, end, mask);
+            if (i < end) {
+                column = i / squareSize;
+                flags[column] = 1;
+                x = (column + 1) * squareSize;
+            }
+            else
+                x = end;
+        }
+    }
+}
+
+
+bool findDirtyTiles(const QImage &image1, const QImage &image2,
+                    const int squareSize, DirtyTiles *tiles)
+{
+    if (squareSize < 1 || image1.size() != image2.size() ||
+        image1.format() != image2.format())
+        return false;
+    quint32 mask;
+    switch (image1.format()) {
+        // QImage::operator==() ignores the undefined alpha of RGB32
+        case QImage::Format_RGB32: mask = 0x00FFFFFF; break;
+        case QImage::Format_ARGB32: // fallthrough
+        case QImage::Format_ARGB32_Premultiplied: mask = 0xFFFFFFFF; break;
+        default: return false;
+    }
+    markDirtyTiles(reinterpret_cast<const quint32*>(image1.bits()),
+                   image1.bytesPerLine() / 4,
+                   reinterpret_cast<const quint32*>(image2.bits()),
+                   image2.bytesPerLine() / 4, image1.width(),
+                   image1.height(), squareSize, mask, tiles);
+    return true;
+}
+
+
+static int findRoot(QVector<int> &parents, int i)
+{
+    while (parents.at(i) != i) {
+        parents[i] = parents.at(parents.at(i)); // path halving
+        i = parents.at(i);
+    }
+    return i;
+}
+
+
+static void unite(QVector<int> &parents, const int i, const int j)
+{
+    const int a = findRoot(parents, i);
+    const int b = findRoot(parents, j);
+    if (a < b) // The earliest tile stays the root
+        parents[b] = a;
+    else if (b < a)
+        parents[a] = b;
+}
+
+
+const QList<QRect> dirtyRegions(const DirtyTiles &tiles,
+        const int squareSize, const QRect &bounds, const int minimumArea)
+{
+    const int Columns = tiles.columnCount();
+    const int Rows = tiles.rowCount();
+    QVector<int> parents(Columns * Rows);
+    for (int row = 0; row < Rows; ++row) {
+        for (int column = 0; column < Columns; ++column) {
+            if (!tiles.isDirty(column, row))
+                continue;
+            const int i = row * Columns + column;
+            parents[i] = i;
+            // Only the neighbours already visited need to be looked at
+            if (column > 0 && tiles.isDirty(column - 1, row))
+                unite(parents, i, i - 1);
+            if (row > 0) {
+                for (int c = qMax(0, column - 1);
+                     c <= qMin(Columns - 1, column + 1); ++c)
+                    if (tiles.isDirty(c, row - 1))
+                        unite(parents, i, i - Columns + (c - column));
+            }
+        }
+    }
+
+    // Roots are visited in row-major order, so the regions come out in
+    // a deterministic order
+    QHash<int, int> regionForRoot;
+    QList<QRect> regions;
+    for (int row = 0; row < Rows; ++row) {
+        for (int column = 0; column < Columns; ++column) {
+            if (!tiles.isDirty(column, row))
+                continue;
+            const int root = findRoot(parents, row * Columns + column);
+            const QRect rect(column * squareSize, row * squareSize,
+                             squareSize, squareSize);
+            if (regionForRoot.contains(root)) {
+                QRect &region = regions[regionForRoot.value(root)];
+                region = region.united(rect);
+            }
+            else {
+                regionForRoot.insert(root, regions.count());
+                regions << rect;
+            }
+        }
+    }
+
+    QList<QRect> result;
+    foreach (const QRect &region, regions) {
+        const QRect clipped = region.intersected(bounds);
+        if (!clipped.isEmpty() &&
+            clipped.width() * clipped.height() >= minimumArea)
+            result << clipped;
+    }
+    return result;
+}
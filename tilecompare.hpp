@@ -0,0 +1,68 @@
+#ifndef TILECOMPARE_HPP
+#define TILECOMPARE_HPP
+/*
+    Copyright © 2008-13 Qtrac Ltd. All rights reserved.
+    This program or module is free software: you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation, either version 2 of
+    the License, or (at your option) any later version. This program is
+    distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+    for more details.
+*/
+
+#include <QImage>
+#include <QList>
+#include <QRect>
+#include <QVector>
+
+
+// One flag per squareSize x squareSize tile of a raster, set if the two
+// rasters differ anywhere inside that tile
+class DirtyTiles
+{
+public:
+    DirtyTiles() : columns(0), rows(0) {}
+
+    void resize(const int columns_, const int rows_)
+        { columns = columns_; rows = rows_; flags.fill(0, columns * rows); }
+    bool isDirty(const int column, const int row) const
+        { return flags.at(row * columns + column); }
+    void setDirty(const int column, const int row, const bool dirty=true)
+        { flags[row * columns + column] = dirty; }
+    int columnCount() const { return columns; }
+    int rowCount() const { return rows; }
+    uchar *row(const int row) { return flags.data() + row * columns; }
+
+private:
+    int columns;
+    int rows;
+    QVector<uchar> flags;
+};
+
+
+// Compares the two rasters in place, one scanline at a time, and marks
+// every tile that differs; this gives the same answers as comparing
+// image1.copy(tile) with image2.copy(tile) for every tile, without the
+// copies. Uses AVX2 or SSE2 when the CPU has them. Returns false (and
+// leaves tiles untouched) if the rasters aren't the same size and of the
+// same 32-bit format, in which case the caller must compare the copies.
+bool findDirtyTiles(const QImage &image1, const QImage &image2,
+                    const int squareSize, DirtyTiles *tiles);
+
+// The scanline kernel findDirtyTiles() uses; by default the best one
+// the CPU has. Picking one is for benchmarking (see bench/) and must be
+// done before any comparing starts. Returns false (changing nothing) if
+// the CPU or the compiler doesn't support the kernel.
+enum TileKernel{BestTileKernel, ScalarTileKernel, Sse2TileKernel,
+                Avx2TileKernel};
+bool setTileKernel(const TileKernel kernel);
+
+// Merges the dirty tiles into one bounding rectangle per group of tiles
+// that touch (including diagonally), clipped to bounds. Regions whose
+// area in pixels is less than minimumArea are dropped as noise.
+const QList<QRect> dirtyRegions(const DirtyTiles &tiles,
+        const int squareSize, const QRect &bounds, const int minimumArea=0);
+
+#endif // TILECOMPARE_HPP